@@ -7,12 +7,18 @@
 #include <llvm/IR/Module.h>
 #include <llvm/IR/PassManager.h>
 
+#include <llvm/Transforms/Utils/DataflowAnalyses.hpp>
+
 namespace firstAssignment { // Namespace to encapsulate the optimization passes
 
 /// @brief Base class for local optimizations.
 /// This class provides a common interface for applying optimizations at the
 /// basic block level. Derived classes should implement the runOnBasicBlock
 /// method to apply specific optimizations.
+/// Dataflow results already cached for a function (see Assignment2) are not
+/// thrown away: every replacement goes through replaceInstruction, which
+/// reports the edit to them, and they are updated incrementally once the
+/// function has been processed.
 class LocalOpts {
 public:
   llvm::PreservedAnalyses run(llvm::Module &, llvm::ModuleAnalysisManager &);
@@ -23,9 +29,15 @@ protected:
   virtual bool runOnBasicBlock(
       llvm::BasicBlock
           &) = 0; // Pure virtual function for basic block optimizations
+  void replaceInstruction(llvm::Instruction &,
+                          llvm::Value *); // Replaces and erases, keeping the
+                                          // tracked dataflow results valid
 
 private:
   bool runOnFunction(llvm::Function &); // Function level optimization
+  void trackCachedAnalyses(llvm::Function &, llvm::FunctionAnalysisManager &);
+
+  llvm::SmallVector<secondAssignment::DataflowAnalysis *, 4> TrackedAnalyses;
 };
 
 /// @brief Pass for performing algebraic identity optimizations within basic
@@ -20,8 +20,9 @@ namespace firstAssignment {
 /// @param InstructionRef Reference to the instruction to check.
 /// @param OutNeutralConstant Output parameter that stores the neutral constant,
 /// if found.
-/// @return True if the instruction can be simplified, false otherwise.
-static bool
+/// @return The operand replacing the instruction, or nullptr if it cannot be
+/// simplified.
+static Value *
 CheckAndSimplifyWithNeutralConstant(Instruction &InstructionRef,
                                     ConstantInt *&OutNeutralConstant) {
   auto OperationCode = InstructionRef.getOpcode();
@@ -46,11 +47,10 @@ CheckAndSimplifyWithNeutralConstant(Instruction &InstructionRef,
     std::swap(Operand1, Operand2); // Ensure Operand2 is checked as the
                                    // potential neutral constant.
   if (!IsNeutralConstant(Operand2))
-    return false; // Exit early if no neutral constant is found.
+    return nullptr; // Exit early if no neutral constant is found.
 
-  // Simplify the instruction by replacing it with the non-neutral operand.
-  InstructionRef.replaceAllUsesWith(Operand1);
-  return true;
+  // The instruction simplifies to the non-neutral operand.
+  return Operand1;
 }
 
 /// Simplifies instructions within a basic block by applying algebraic identity
@@ -66,12 +66,15 @@ bool AlgebraicIdentityPass::runOnBasicBlock(BasicBlock &BasicBlockRef) {
   for (Instruction &InstructionRef :
        llvm::make_early_inc_range(BasicBlockRef)) {
     ConstantInt *NeutralConstant = nullptr;
-    if ((InstructionRef.getOpcode() == Instruction::Add ||
-         InstructionRef.getOpcode() == Instruction::Mul) &&
-        CheckAndSimplifyWithNeutralConstant(InstructionRef, NeutralConstant)) {
+    if (InstructionRef.getOpcode() != Instruction::Add &&
+        InstructionRef.getOpcode() != Instruction::Mul)
+      continue;
+
+    if (Value *Replacement = CheckAndSimplifyWithNeutralConstant(
+            InstructionRef, NeutralConstant)) {
       HasModificationOccurred = true;
-      InstructionRef
-          .eraseFromParent(); // Remove the simplified instruction safely.
+      replaceInstruction(InstructionRef,
+                         Replacement); // Remove the simplified instruction.
     }
   }
   return HasModificationOccurred;
@@ -2,7 +2,9 @@
 #include <llvm/IR/PassManager.h>
 #include <llvm/Passes/PassBuilder.h>
 #include <llvm/Passes/PassPlugin.h>
+#include <llvm/Transforms/Utils/BasicBlockUtils.h>
 
+#include <llvm/Transforms/Utils/DataflowAnalyses.hpp>
 #include <llvm/Transforms/Utils/LocalOpts.hpp>
 
 using namespace llvm;
@@ -23,21 +25,73 @@ bool LocalOpts::runOnFunction(Function &function) {
   return transformed;
 }
 
+/// Collects the dataflow results that are already cached for a function. Only
+/// those are kept up to date: results nobody asked for are not computed.
+///
+/// @param function Reference to the function about to be optimized.
+/// @param manager Reference to the function analysis manager.
+void LocalOpts::trackCachedAnalyses(Function &function,
+                                    FunctionAnalysisManager &manager) {
+  TrackedAnalyses =
+      secondAssignment::getCachedDataflowResults(function, manager);
+}
+
+/// Replaces all uses of an instruction with a value and erases it. The edit
+/// is reported to the tracked dataflow results first, while the uses of the
+/// instruction can still be inspected.
+///
+/// @param instruction Reference to the instruction to replace.
+/// @param replacement The value taking its place.
+void LocalOpts::replaceInstruction(Instruction &instruction,
+                                   Value *replacement) {
+  for (auto *analysis : TrackedAnalyses) {
+    analysis->instructionWillBeReplaced(instruction);
+  }
+  BasicBlock::iterator instIterator = instruction.getIterator();
+  ReplaceInstWithValue(instIterator, replacement);
+}
+
 /// Optimizes each function within a given LLVM module by applying specific
 /// optimization techniques. Iterates over all functions in the module and
 /// applies optimization passes.
 ///
+/// The passes never touch the control flow graph, so CFG analyses survive.
+/// Cached dataflow results are updated in place, with a cost proportional to
+/// the edits, and reported as preserved.
+///
 /// @param ModuleRef Reference to the module being optimized.
 /// @param AnalysisManagerRef Reference to the module's analysis manager.
 /// @return A set of analyses that are preserved after the optimization passes.
 PreservedAnalyses LocalOpts::run(Module &module,
                                  ModuleAnalysisManager &manager) {
+  auto &functionManager =
+      manager.getResult<FunctionAnalysisManagerModuleProxy>(module)
+          .getManager();
+
+  bool transformed = false;
   for (auto &function : module) {
+    if (function.isDeclaration()) {
+      continue;
+    }
+    trackCachedAnalyses(function, functionManager);
     if (runOnFunction(function)) {
-      return PreservedAnalyses::none();
+      transformed = true;
     }
+    for (auto *analysis : TrackedAnalyses) {
+      analysis->update();
+    }
+  }
+  TrackedAnalyses.clear();
+
+  if (!transformed) {
+    return PreservedAnalyses::all();
   }
-  return PreservedAnalyses::none();
+
+  PreservedAnalyses preserved;
+  preserved.preserveSet<CFGAnalyses>();
+  preserved.preserve<FunctionAnalysisManagerModuleProxy>();
+  secondAssignment::preserveDataflowResults(preserved);
+  return preserved;
 }
 
 } // namespace firstAssignment
@@ -180,8 +180,7 @@ bool MIOptimizationPass::runOnBasicBlock(BasicBlock &basicBlock) {
 
   // Apply all collected simplifications.
   for (auto &[inst, newVal] : replacements) {
-    auto instIterator = inst->getIterator();
-    ReplaceInstWithValue(instIterator, newVal);
+    replaceInstruction(*inst, newVal);
     isModified = true;
   }
 
@@ -55,13 +55,14 @@ bool isOptimizableConstant(const Value *Operand,
 /// optimize the operations by utilizing shifts and additions or subtractions.
 ///
 /// @param InstructionRef Reference to the instruction to potentially optimize.
-/// @return True if the instruction was optimized; otherwise, false.
-bool applyStrengthReduction(Instruction &InstructionRef) {
+/// @return The cheaper equivalent of the instruction, or nullptr if it cannot
+/// be optimized.
+Value *applyStrengthReduction(Instruction &InstructionRef) {
   auto OperationCode = InstructionRef.getOpcode();
   // Check if operation is eligible for strength reduction
   if (OperationCode != Instruction::Mul && OperationCode != Instruction::SDiv &&
       OperationCode != Instruction::UDiv)
-    return false;
+    return nullptr;
 
   Value *Operand1 = InstructionRef.getOperand(0);
   Value *Operand2 = InstructionRef.getOperand(1);
@@ -76,7 +77,7 @@ bool applyStrengthReduction(Instruction &InstructionRef) {
       (OperationCode != Instruction::Mul &&
        !isOptimizableConstant(Operand2, &OptimizableConst, ShouldSubtract,
                               ShiftValue)))
-    return false;
+    return nullptr;
 
   IRBuilder<> Builder(&InstructionRef);
   Value *ShiftedValue = nullptr;
@@ -104,14 +105,7 @@ bool applyStrengthReduction(Instruction &InstructionRef) {
     }
   }
 
-  // Replace original instruction with optimized one if applicable
-  if (OptimizedInstruction) {
-    InstructionRef.replaceAllUsesWith(OptimizedInstruction);
-    InstructionRef.eraseFromParent();
-    return true;
-  }
-
-  return false;
+  return OptimizedInstruction;
 }
 
 /// Iterates over all instructions within a given basic block and applies
@@ -123,7 +117,11 @@ bool applyStrengthReduction(Instruction &InstructionRef) {
 bool StrengthReductionPass::runOnBasicBlock(BasicBlock &BasicBlockRef) {
   bool HasChanged = false;
   for (auto &Inst : llvm::make_early_inc_range(BasicBlockRef)) {
-    HasChanged |= applyStrengthReduction(Inst);
+    // Replace original instruction with optimized one if applicable
+    if (Value *OptimizedInstruction = applyStrengthReduction(Inst)) {
+      replaceInstruction(Inst, OptimizedInstruction);
+      HasChanged = true;
+    }
   }
   return HasChanged;
 }
@@ -0,0 +1,287 @@
+#ifndef DATAFLOW_ANALYSES_HPP // Traditional include guard for broader compatibility
+#define DATAFLOW_ANALYSES_HPP
+
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/BitVector.h>
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/SetVector.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/IR/BasicBlock.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/Instruction.h>
+#include <llvm/IR/PassManager.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <optional>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+namespace secondAssignment { // Namespace to encapsulate the dataflow analyses
+
+/// @brief Direction in which facts flow through the control flow graph.
+enum class DataflowDirection { Forward, Backward };
+
+/// @brief Operator combining the facts coming from several predecessors (or
+/// successors, for backward problems).
+enum class MeetOperator { Union, Intersection };
+
+/// @brief Dense numbering of the `x op y` expressions of a function.
+/// Expressions are hash-consed on opcode, type and operands (commutative
+/// operands are put in a canonical order), so every instruction computing the
+/// same value maps to the same id. Ids are never reused: forgetting a value
+/// only drops the table entries that mention it.
+class ExpressionDomain {
+public:
+  static bool isCandidate(const llvm::Instruction &);
+
+  std::optional<unsigned> lookup(const llvm::Instruction &) const;
+  /// Returns the id of the expression and whether it was just created.
+  std::pair<unsigned, bool> getOrInsert(const llvm::Instruction &);
+  llvm::ArrayRef<unsigned> getExpressionsUsing(const llvm::Value *) const;
+  void forget(const llvm::Value *);
+
+  unsigned size() const { return Expressions.size(); }
+  void print(llvm::raw_ostream &, unsigned) const;
+
+private:
+  using Key = std::tuple<unsigned, llvm::Type *, llvm::Value *, llvm::Value *>;
+  static Key getKey(const llvm::Instruction &);
+
+  llvm::DenseMap<Key, unsigned> Ids;
+  std::vector<Key> Expressions;
+  llvm::DenseMap<const llvm::Value *, llvm::SmallVector<unsigned, 2>> Users;
+};
+
+/// @brief Dense numbering of the SSA values that need a register: function
+/// arguments and instructions producing a value.
+class ValueDomain {
+public:
+  static bool isCandidate(const llvm::Value &);
+
+  std::optional<unsigned> lookup(const llvm::Value *) const;
+  /// Returns the id of the value and whether it was just created.
+  std::pair<unsigned, bool> getOrInsert(const llvm::Value *);
+  /// Returns the value with the given id, or nullptr if it was forgotten.
+  const llvm::Value *getValue(unsigned Id) const { return Values[Id]; }
+  void forget(const llvm::Value *);
+
+  unsigned size() const { return Values.size(); }
+
+private:
+  llvm::DenseMap<const llvm::Value *, unsigned> Ids;
+  std::vector<const llvm::Value *> Values;
+};
+
+/// @brief Iterative solver for bit-vector dataflow problems, shaped after the
+/// framework tables of Assignment2: a domain, a direction, the transfer
+/// function `Gen ∪ (x - Kill)`, a meet operator, an empty boundary condition
+/// and `U` (intersection) or `∅` (union) as initial interior points.
+///
+/// Results can also be kept up to date under local edits. A transform reports
+/// the instruction it is about to replace; the blocks whose Gen/Kill sets
+/// depend on it are marked dirty and `update` recomputes only those sets,
+/// propagating the changes through a worklist seeded with the dirty blocks.
+/// The incremental result is always a fixpoint of the edited equations, so
+/// it stays sound; it may be less precise than a full `solve` when an edit
+/// creates a fact that has to flow around a loop.
+class DataflowAnalysis {
+public:
+  DataflowAnalysis(DataflowDirection, MeetOperator);
+  virtual ~DataflowAnalysis() = default;
+  DataflowAnalysis(DataflowAnalysis &&) = default;
+  DataflowAnalysis &operator=(DataflowAnalysis &&) = default;
+
+  void solve(llvm::Function &);
+  void instructionWillBeReplaced(llvm::Instruction &);
+  void update();
+
+  const llvm::BitVector &getIn(const llvm::BasicBlock &) const;
+  const llvm::BitVector &getOut(const llvm::BasicBlock &) const;
+  const llvm::BitVector &getGen(const llvm::BasicBlock &) const;
+  const llvm::BitVector &getKill(const llvm::BasicBlock &) const;
+  void print(llvm::raw_ostream &) const;
+
+protected:
+  virtual unsigned getDomainSize() const = 0;
+  virtual void buildDomain(llvm::Function &) {}
+  virtual void computeGenKill(const llvm::BasicBlock &, llvm::BitVector &Gen,
+                              llvm::BitVector &Kill) = 0;
+  virtual void valueWillBeErased(const llvm::Value &) {}
+  virtual void printFact(llvm::raw_ostream &, unsigned) const = 0;
+
+  void markDirty(const llvm::BasicBlock *);
+  static void addFact(llvm::BitVector &, unsigned);
+
+private:
+  struct BlockState {
+    llvm::BitVector Gen, Kill, In, Out;
+  };
+
+  DataflowDirection Direction;
+  MeetOperator Meet;
+  llvm::Function *Fn = nullptr;
+  unsigned Capacity = 0;
+  llvm::DenseMap<const llvm::BasicBlock *, BlockState> States;
+  llvm::SmallSetVector<const llvm::BasicBlock *, 8> Dirty;
+
+  void recomputeDirtyBlocks(
+      llvm::SmallSetVector<const llvm::BasicBlock *, 8> &Worklist);
+  void ensureCapacity(unsigned);
+  bool propagate(llvm::SmallSetVector<const llvm::BasicBlock *, 8> &Worklist,
+                 unsigned Budget);
+  bool visit(const llvm::BasicBlock &, BlockState &);
+};
+
+/// @brief Common base for the analyses whose domain is the set of `x op y`
+/// expressions. In SSA form an expression is killed by the block defining one
+/// of its operands (a phi, in a loop header, "redefines" it every iteration).
+class ExpressionDataflowAnalysis : public DataflowAnalysis {
+public:
+  using DataflowAnalysis::DataflowAnalysis;
+
+  const ExpressionDomain &getDomain() const { return Domain; }
+
+protected:
+  ExpressionDomain Domain;
+
+  unsigned getDomainSize() const override { return Domain.size(); }
+  void buildDomain(llvm::Function &) override;
+  void valueWillBeErased(const llvm::Value &) override;
+  void printFact(llvm::raw_ostream &, unsigned) const override;
+
+  std::optional<unsigned> intern(const llvm::Instruction &);
+  void addKilledExpressions(const llvm::Instruction &, llvm::BitVector &Kill);
+};
+
+/// @brief Very busy expressions: backward, intersection. An expression is
+/// very busy at a point if it is evaluated on every path leaving it before
+/// any of its operands changes.
+class VeryBusyExpressions : public ExpressionDataflowAnalysis {
+public:
+  VeryBusyExpressions();
+
+protected:
+  void computeGenKill(const llvm::BasicBlock &, llvm::BitVector &Gen,
+                      llvm::BitVector &Kill) override;
+};
+
+/// @brief Available expressions: forward, intersection. An expression is
+/// available at a point if it is evaluated on every path reaching it and none
+/// of its operands changed since.
+class AvailableExpressions : public ExpressionDataflowAnalysis {
+public:
+  AvailableExpressions();
+
+protected:
+  void computeGenKill(const llvm::BasicBlock &, llvm::BitVector &Gen,
+                      llvm::BitVector &Kill) override;
+};
+
+/// @brief Liveness of SSA values: backward, union. A phi operand is used at
+/// the end of the corresponding predecessor, so it is part of that block's
+/// Gen set (when defined elsewhere) rather than of the phi's block.
+class Liveness : public DataflowAnalysis {
+public:
+  Liveness();
+
+  const ValueDomain &getDomain() const { return Domain; }
+  /// OUT of the block plus the values its successors' phis read along its
+  /// outgoing edges, i.e. everything holding a register at its terminator.
+  llvm::BitVector getLiveOut(const llvm::BasicBlock &) const;
+
+protected:
+  ValueDomain Domain;
+
+  unsigned getDomainSize() const override { return Domain.size(); }
+  void buildDomain(llvm::Function &) override;
+  void computeGenKill(const llvm::BasicBlock &, llvm::BitVector &Gen,
+                      llvm::BitVector &Kill) override;
+  void valueWillBeErased(const llvm::Value &) override;
+  void printFact(llvm::raw_ostream &, unsigned) const override;
+
+private:
+  std::optional<unsigned> intern(const llvm::Value *);
+};
+
+/// @brief Analysis pass wrapping VeryBusyExpressions, so the result can be
+/// cached by the function analysis manager and updated in place by the
+/// LocalOpts passes.
+class VeryBusyExpressionsAnalysis
+    : public llvm::AnalysisInfoMixin<VeryBusyExpressionsAnalysis> {
+  friend llvm::AnalysisInfoMixin<VeryBusyExpressionsAnalysis>;
+  static llvm::AnalysisKey Key;
+
+public:
+  using Result = VeryBusyExpressions;
+  Result run(llvm::Function &, llvm::FunctionAnalysisManager &);
+};
+
+/// @brief Printer pass for the very busy expressions of each block.
+class VeryBusyExpressionsPrinterPass
+    : public llvm::PassInfoMixin<VeryBusyExpressionsPrinterPass> {
+public:
+  explicit VeryBusyExpressionsPrinterPass(llvm::raw_ostream &OS) : OS(OS) {}
+  llvm::PreservedAnalyses run(llvm::Function &,
+                              llvm::FunctionAnalysisManager &);
+
+private:
+  llvm::raw_ostream &OS;
+};
+
+/// @brief Analysis pass wrapping AvailableExpressions.
+class AvailableExpressionsAnalysis
+    : public llvm::AnalysisInfoMixin<AvailableExpressionsAnalysis> {
+  friend llvm::AnalysisInfoMixin<AvailableExpressionsAnalysis>;
+  static llvm::AnalysisKey Key;
+
+public:
+  using Result = AvailableExpressions;
+  Result run(llvm::Function &, llvm::FunctionAnalysisManager &);
+};
+
+/// @brief Printer pass for the available expressions of each block.
+class AvailableExpressionsPrinterPass
+    : public llvm::PassInfoMixin<AvailableExpressionsPrinterPass> {
+public:
+  explicit AvailableExpressionsPrinterPass(llvm::raw_ostream &OS) : OS(OS) {}
+  llvm::PreservedAnalyses run(llvm::Function &,
+                              llvm::FunctionAnalysisManager &);
+
+private:
+  llvm::raw_ostream &OS;
+};
+
+/// @brief Analysis pass wrapping Liveness.
+class LivenessAnalysis : public llvm::AnalysisInfoMixin<LivenessAnalysis> {
+  friend llvm::AnalysisInfoMixin<LivenessAnalysis>;
+  static llvm::AnalysisKey Key;
+
+public:
+  using Result = Liveness;
+  Result run(llvm::Function &, llvm::FunctionAnalysisManager &);
+};
+
+/// @brief Printer pass for the live values of each block.
+class LivenessPrinterPass : public llvm::PassInfoMixin<LivenessPrinterPass> {
+public:
+  explicit LivenessPrinterPass(llvm::raw_ostream &OS) : OS(OS) {}
+  llvm::PreservedAnalyses run(llvm::Function &,
+                              llvm::FunctionAnalysisManager &);
+
+private:
+  llvm::raw_ostream &OS;
+};
+
+/// Returns the dataflow results already cached for a function. Transforms
+/// report their edits to them instead of invalidating them.
+llvm::SmallVector<DataflowAnalysis *, 4>
+getCachedDataflowResults(llvm::Function &, llvm::FunctionAnalysisManager &);
+
+/// Marks every dataflow analysis as preserved. Only valid once the cached
+/// results have been brought up to date with DataflowAnalysis::update.
+void preserveDataflowResults(llvm::PreservedAnalyses &);
+
+} // namespace secondAssignment
+
+#endif // DATAFLOW_ANALYSES_HPP
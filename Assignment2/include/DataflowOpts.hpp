@@ -0,0 +1,33 @@
+#ifndef DATAFLOW_OPTS_HPP // Traditional include guard for broader compatibility
+#define DATAFLOW_OPTS_HPP
+
+#include <llvm/IR/Function.h>
+#include <llvm/IR/PassManager.h>
+
+#include <llvm/Transforms/Utils/DataflowAnalyses.hpp>
+
+namespace secondAssignment { // Namespace to encapsulate the dataflow analyses
+
+/// @brief Global common subexpression elimination. Walks the dominator tree
+/// keeping, for every hash-consed expression, the dominating instruction that
+/// first computed it; later recomputations are replaced with that value.
+class GlobalCSEPass : public llvm::PassInfoMixin<GlobalCSEPass> {
+public:
+  llvm::PreservedAnalyses run(llvm::Function &,
+                              llvm::FunctionAnalysisManager &);
+};
+
+/// @brief Lazy code motion (Knoop, Rüthing and Steffen). Partial redundancy
+/// elimination combining anticipability (very busy expressions) and
+/// availability: every expression is computed as late as possible among the
+/// earliest points that remove all the redundancies, without adding
+/// computations to any path.
+class LazyCodeMotionPass : public llvm::PassInfoMixin<LazyCodeMotionPass> {
+public:
+  llvm::PreservedAnalyses run(llvm::Function &,
+                              llvm::FunctionAnalysisManager &);
+};
+
+} // namespace secondAssignment
+
+#endif // DATAFLOW_OPTS_HPP
@@ -0,0 +1,54 @@
+#include <llvm/IR/BasicBlock.h>
+#include <llvm/IR/Instruction.h>
+#include <llvm/IR/PassManager.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <llvm/Transforms/Utils/DataflowAnalyses.hpp>
+
+using namespace llvm;
+
+namespace secondAssignment {
+
+AvailableExpressions::AvailableExpressions()
+    : ExpressionDataflowAnalysis(DataflowDirection::Forward,
+                                 MeetOperator::Intersection) {}
+
+/// Gen contains every expression evaluated in the block: in SSA form nothing
+/// later in the block can redefine its operands. Kill contains every
+/// expression using a value defined in the block; the transfer function adds
+/// Gen back, so expressions recomputed after such a definition survive.
+///
+/// @param BB Reference to the basic block.
+/// @param Gen Output set of generated expressions.
+/// @param Kill Output set of killed expressions.
+void AvailableExpressions::computeGenKill(const BasicBlock &BB, BitVector &Gen,
+                                          BitVector &Kill) {
+  for (const Instruction &I : BB) {
+    if (auto Id = intern(I))
+      addFact(Gen, *Id);
+    addKilledExpressions(I, Kill);
+  }
+}
+
+AnalysisKey AvailableExpressionsAnalysis::Key;
+
+/// Computes the available expressions of a function from scratch.
+///
+/// @param F Reference to the function to analyze.
+/// @return The solved analysis, ready to be updated incrementally.
+AvailableExpressions
+AvailableExpressionsAnalysis::run(Function &F, FunctionAnalysisManager &) {
+  AvailableExpressions Result;
+  Result.solve(F);
+  return Result;
+}
+
+PreservedAnalyses
+AvailableExpressionsPrinterPass::run(Function &F,
+                                     FunctionAnalysisManager &FAM) {
+  OS << "Available expressions for function '" << F.getName() << "':\n";
+  FAM.getResult<AvailableExpressionsAnalysis>(F).print(OS);
+  return PreservedAnalyses::all();
+}
+
+} // namespace secondAssignment
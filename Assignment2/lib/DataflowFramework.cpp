@@ -0,0 +1,420 @@
+#include <llvm/ADT/PostOrderIterator.h>
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/IR/CFG.h>
+#include <llvm/IR/InstrTypes.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <llvm/Transforms/Utils/DataflowAnalyses.hpp>
+
+using namespace llvm;
+
+namespace secondAssignment {
+
+/// Upper bound on the block visits of an incremental update, as a multiple of
+/// the number of blocks. Past it the update falls back to a full solve.
+static constexpr unsigned IncrementalVisitFactor = 4;
+
+/// Only side-effect free binary operators take part in the expression
+/// domain, which matches the `a - b` style expressions of Assignment2.
+///
+/// @param I Reference to the instruction to check.
+/// @return True if I computes an expression of the domain.
+bool ExpressionDomain::isCandidate(const Instruction &I) {
+  return isa<BinaryOperator>(I) && !I.mayHaveSideEffects();
+}
+
+/// Builds the hash-consing key of an instruction. Commutative operands are
+/// sorted so that `a + b` and `b + a` share the same key.
+///
+/// @param I Reference to a candidate instruction.
+/// @return The key identifying the expression computed by I.
+ExpressionDomain::Key ExpressionDomain::getKey(const Instruction &I) {
+  Value *LHS = I.getOperand(0);
+  Value *RHS = I.getOperand(1);
+  if (I.isCommutative() && std::less<Value *>()(RHS, LHS))
+    std::swap(LHS, RHS);
+  return {I.getOpcode(), I.getType(), LHS, RHS};
+}
+
+/// @param I Reference to the instruction to look up.
+/// @return The id of the expression computed by I, if it is in the domain.
+std::optional<unsigned> ExpressionDomain::lookup(const Instruction &I) const {
+  if (!isCandidate(I))
+    return std::nullopt;
+  auto It = Ids.find(getKey(I));
+  if (It == Ids.end())
+    return std::nullopt;
+  return It->second;
+}
+
+/// Interns the expression computed by a candidate instruction.
+///
+/// @param I Reference to a candidate instruction.
+/// @return The id of the expression and true if it has just been created.
+std::pair<unsigned, bool> ExpressionDomain::getOrInsert(const Instruction &I) {
+  Key K = getKey(I);
+  auto [It, Inserted] = Ids.try_emplace(K, Expressions.size());
+  if (Inserted) {
+    Expressions.push_back(K);
+    Users[std::get<2>(K)].push_back(It->second);
+    if (std::get<3>(K) != std::get<2>(K))
+      Users[std::get<3>(K)].push_back(It->second);
+  }
+  return {It->second, Inserted};
+}
+
+/// @param V The value whose defining block kills the returned expressions.
+/// @return The ids of the expressions having V as an operand.
+ArrayRef<unsigned> ExpressionDomain::getExpressionsUsing(const Value *V) const {
+  auto It = Users.find(V);
+  if (It == Users.end())
+    return {};
+  return It->second;
+}
+
+/// Drops every expression having V as an operand, so that a value allocated
+/// later at the same address cannot alias a stale entry.
+///
+/// @param V The value about to be erased.
+void ExpressionDomain::forget(const Value *V) {
+  auto It = Users.find(V);
+  if (It == Users.end())
+    return;
+  for (unsigned Id : It->second) {
+    Ids.erase(Expressions[Id]);
+    Expressions[Id] = Key();
+  }
+  Users.erase(It);
+}
+
+/// Prints an expression as `opcode lhs, rhs`.
+void ExpressionDomain::print(raw_ostream &OS, unsigned Id) const {
+  const auto &[Opcode, Ty, LHS, RHS] = Expressions[Id];
+  if (!LHS) {
+    OS << "<erased>";
+    return;
+  }
+  OS << Instruction::getOpcodeName(Opcode) << ' ';
+  LHS->printAsOperand(OS, false);
+  OS << ", ";
+  RHS->printAsOperand(OS, false);
+}
+
+DataflowAnalysis::DataflowAnalysis(DataflowDirection Direction,
+                                   MeetOperator Meet)
+    : Direction(Direction), Meet(Meet) {}
+
+/// Solves the problem from scratch: builds the domain, computes the Gen/Kill
+/// sets of every block, initializes the interior points and iterates in
+/// reverse post-order (post-order for backward problems) until fixpoint.
+///
+/// @param F Reference to the function to analyze.
+void DataflowAnalysis::solve(Function &F) {
+  Fn = &F;
+  Capacity = 0;
+  States.clear();
+  Dirty.clear();
+
+  buildDomain(F);
+  for (auto &BB : F) {
+    States[&BB];
+    Dirty.insert(&BB);
+  }
+  SmallSetVector<const BasicBlock *, 8> Unused;
+  recomputeDirtyBlocks(Unused);
+
+  BitVector Interior(Capacity);
+  if (Meet == MeetOperator::Intersection)
+    Interior.set(0, getDomainSize());
+  for (auto &[BB, State] : States) {
+    State.In = Interior;
+    State.Out = Interior;
+  }
+
+  // The worklist is processed from the back, so it is filled in the reverse
+  // of the preferred visiting order.
+  SmallSetVector<const BasicBlock *, 8> Worklist;
+  if (Direction == DataflowDirection::Forward) {
+    for (const BasicBlock *BB : post_order(&F.getEntryBlock()))
+      Worklist.insert(BB);
+  } else {
+    ReversePostOrderTraversal<Function *> RPOT(&F);
+    for (const BasicBlock *BB : RPOT)
+      Worklist.insert(BB);
+  }
+  // Unreachable blocks still need a (boundary) value.
+  for (auto &BB : F)
+    Worklist.insert(&BB);
+
+  propagate(Worklist, ~0U);
+}
+
+/// Records that an instruction is about to be replaced and erased. The block
+/// defining it and the blocks of its users (whose expressions change once the
+/// uses are rewritten) are marked dirty. A phi reads its operand at the end of
+/// the incoming block, where liveness puts the use, so that block is marked
+/// dirty too.
+///
+/// @param I Reference to the instruction being replaced.
+void DataflowAnalysis::instructionWillBeReplaced(Instruction &I) {
+  if (!Fn)
+    return;
+  markDirty(I.getParent());
+  for (Use &U : I.uses()) {
+    auto *UserInst = dyn_cast<Instruction>(U.getUser());
+    if (!UserInst)
+      continue;
+    markDirty(UserInst->getParent());
+    if (auto *Phi = dyn_cast<PHINode>(UserInst))
+      markDirty(Phi->getIncomingBlock(U));
+  }
+  valueWillBeErased(I);
+}
+
+/// Brings the results up to date after a sequence of edits. Only the Gen/Kill
+/// sets of the dirty blocks are recomputed, and the worklist starts from them.
+void DataflowAnalysis::update() {
+  if (!Fn || Dirty.empty())
+    return;
+
+  SmallSetVector<const BasicBlock *, 8> Worklist;
+  recomputeDirtyBlocks(Worklist);
+  if (!propagate(Worklist, IncrementalVisitFactor * States.size()))
+    solve(*Fn);
+}
+
+/// Recomputes the Gen/Kill sets of the dirty blocks. Computing them may mark
+/// further blocks dirty (e.g. a new expression has to be killed where its
+/// operands are defined), so the loop runs until no block is left.
+///
+/// @param Worklist Output set collecting every recomputed block.
+void DataflowAnalysis::recomputeDirtyBlocks(
+    SmallSetVector<const BasicBlock *, 8> &Worklist) {
+  while (!Dirty.empty()) {
+    const BasicBlock *BB = Dirty.pop_back_val();
+    BlockState &State = States[BB];
+    State.Gen.reset();
+    State.Kill.reset();
+    computeGenKill(*BB, State.Gen, State.Kill);
+    Worklist.insert(BB);
+  }
+  ensureCapacity(getDomainSize());
+}
+
+/// Grows every bit vector to hold at least Size facts. Capacity doubles so
+/// that a growing domain costs amortized constant time per new fact; the new
+/// bits start cleared, which is the conservative value for both meets.
+///
+/// @param Size The number of facts that must fit.
+void DataflowAnalysis::ensureCapacity(unsigned Size) {
+  if (Size <= Capacity)
+    return;
+
+  Capacity = std::max(Size, 2 * Capacity);
+  for (auto &[BB, State] : States) {
+    State.Gen.resize(Capacity);
+    State.Kill.resize(Capacity);
+    State.In.resize(Capacity);
+    State.Out.resize(Capacity);
+  }
+}
+
+/// Runs the worklist algorithm until fixpoint.
+///
+/// @param Worklist Blocks to visit first.
+/// @param Budget Maximum number of block visits.
+/// @return False if the budget ran out before reaching the fixpoint.
+bool DataflowAnalysis::propagate(
+    SmallSetVector<const BasicBlock *, 8> &Worklist, unsigned Budget) {
+  unsigned Visits = 0;
+  while (!Worklist.empty()) {
+    if (++Visits > Budget)
+      return false;
+
+    const BasicBlock *BB = Worklist.pop_back_val();
+    if (!visit(*BB, States[BB]))
+      continue;
+
+    if (Direction == DataflowDirection::Forward) {
+      for (const BasicBlock *Succ : successors(BB))
+        Worklist.insert(Succ);
+    } else {
+      for (const BasicBlock *Pred : predecessors(BB))
+        Worklist.insert(Pred);
+    }
+  }
+  return true;
+}
+
+/// Applies meet and transfer function to a single block.
+///
+/// @param BB Reference to the block to visit.
+/// @param State The dataflow sets of BB.
+/// @return True if the output of the transfer function changed.
+bool DataflowAnalysis::visit(const BasicBlock &BB, BlockState &State) {
+  bool Forward = Direction == DataflowDirection::Forward;
+  BitVector &Input = Forward ? State.In : State.Out;
+  BitVector &Output = Forward ? State.Out : State.In;
+
+  bool HasNeighbour = false;
+  auto MeetWith = [&](const BitVector &Facts) {
+    if (!HasNeighbour)
+      Input = Facts;
+    else if (Meet == MeetOperator::Union)
+      Input |= Facts;
+    else
+      Input &= Facts;
+    HasNeighbour = true;
+  };
+
+  // The entry block (exit blocks, going backward) takes the boundary
+  // condition, which is the empty set for every problem of Assignment2.
+  if (Forward) {
+    if (!BB.isEntryBlock())
+      for (const BasicBlock *Pred : predecessors(&BB))
+        MeetWith(States[Pred].Out);
+  } else {
+    for (const BasicBlock *Succ : successors(&BB))
+      MeetWith(States[Succ].In);
+  }
+  if (!HasNeighbour)
+    Input.reset();
+
+  BitVector NewOutput = Input;
+  NewOutput.reset(State.Kill);
+  NewOutput |= State.Gen;
+  if (NewOutput == Output)
+    return false;
+  Output = std::move(NewOutput);
+  return true;
+}
+
+/// @return The facts holding at the entry of BB.
+const BitVector &DataflowAnalysis::getIn(const BasicBlock &BB) const {
+  return States.find(&BB)->second.In;
+}
+
+/// @return The facts holding at the exit of BB.
+const BitVector &DataflowAnalysis::getOut(const BasicBlock &BB) const {
+  return States.find(&BB)->second.Out;
+}
+
+/// @return The facts generated by BB.
+const BitVector &DataflowAnalysis::getGen(const BasicBlock &BB) const {
+  return States.find(&BB)->second.Gen;
+}
+
+/// @return The facts killed by BB.
+const BitVector &DataflowAnalysis::getKill(const BasicBlock &BB) const {
+  return States.find(&BB)->second.Kill;
+}
+
+/// Marks a block whose Gen/Kill sets must be recomputed by the next update.
+void DataflowAnalysis::markDirty(const BasicBlock *BB) {
+  if (States.count(BB))
+    Dirty.insert(BB);
+}
+
+/// Sets a fact, growing the vector if the fact was just added to the domain.
+void DataflowAnalysis::addFact(BitVector &Facts, unsigned Id) {
+  if (Id >= Facts.size())
+    Facts.resize(Id + 1);
+  Facts.set(Id);
+}
+
+/// Prints the IN and OUT sets of every block, in the style of the tables of
+/// Assignment2.
+void DataflowAnalysis::print(raw_ostream &OS) const {
+  if (!Fn)
+    return;
+
+  auto PrintSet = [&](const BitVector &Facts) {
+    OS << '{';
+    bool First = true;
+    for (unsigned Id : Facts.set_bits()) {
+      OS << (First ? " " : ", ");
+      printFact(OS, Id);
+      First = false;
+    }
+    OS << " }";
+  };
+
+  for (const auto &BB : *Fn) {
+    BB.printAsOperand(OS, false);
+    OS << "\n  IN:  ";
+    PrintSet(getIn(BB));
+    OS << "\n  OUT: ";
+    PrintSet(getOut(BB));
+    OS << '\n';
+  }
+}
+
+/// Interns every candidate expression of the function up front, so that a
+/// full solve computes each Gen/Kill set exactly once.
+void ExpressionDataflowAnalysis::buildDomain(Function &F) {
+  Domain = ExpressionDomain();
+  for (auto &BB : F)
+    for (auto &I : BB)
+      if (ExpressionDomain::isCandidate(I))
+        Domain.getOrInsert(I);
+}
+
+void ExpressionDataflowAnalysis::valueWillBeErased(const Value &V) {
+  Domain.forget(&V);
+}
+
+void ExpressionDataflowAnalysis::printFact(raw_ostream &OS,
+                                           unsigned Id) const {
+  Domain.print(OS, Id);
+}
+
+/// Interns the expression computed by I. When the expression is new (an edit
+/// created it), the blocks defining its operands must now kill it, so they
+/// are marked dirty as well.
+///
+/// @param I Reference to the instruction to intern.
+/// @return The id of its expression, or nothing if I is not a candidate.
+std::optional<unsigned>
+ExpressionDataflowAnalysis::intern(const Instruction &I) {
+  if (!ExpressionDomain::isCandidate(I))
+    return std::nullopt;
+
+  auto [Id, Inserted] = Domain.getOrInsert(I);
+  if (Inserted)
+    for (const Value *Operand : I.operands())
+      if (auto *OperandInst = dyn_cast<Instruction>(Operand))
+        markDirty(OperandInst->getParent());
+  return Id;
+}
+
+/// Adds to Kill the expressions that use the value defined by I.
+void ExpressionDataflowAnalysis::addKilledExpressions(const Instruction &I,
+                                                      BitVector &Kill) {
+  for (unsigned Id : Domain.getExpressionsUsing(&I))
+    addFact(Kill, Id);
+}
+
+/// @param F Reference to the function about to be transformed.
+/// @param FAM Reference to the function analysis manager.
+/// @return The dataflow results that are cached for F.
+SmallVector<DataflowAnalysis *, 4>
+getCachedDataflowResults(Function &F, FunctionAnalysisManager &FAM) {
+  SmallVector<DataflowAnalysis *, 4> Results;
+  if (auto *VeryBusy = FAM.getCachedResult<VeryBusyExpressionsAnalysis>(F))
+    Results.push_back(VeryBusy);
+  if (auto *Available = FAM.getCachedResult<AvailableExpressionsAnalysis>(F))
+    Results.push_back(Available);
+  if (auto *Live = FAM.getCachedResult<LivenessAnalysis>(F))
+    Results.push_back(Live);
+  return Results;
+}
+
+/// @param PA The preserved analyses set of a transform.
+void preserveDataflowResults(PreservedAnalyses &PA) {
+  PA.preserve<VeryBusyExpressionsAnalysis>();
+  PA.preserve<AvailableExpressionsAnalysis>();
+  PA.preserve<LivenessAnalysis>();
+}
+
+} // namespace secondAssignment
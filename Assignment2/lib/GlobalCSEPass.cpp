@@ -0,0 +1,127 @@
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/IR/BasicBlock.h>
+#include <llvm/IR/Dominators.h>
+#include <llvm/IR/Instruction.h>
+#include <llvm/IR/PassManager.h>
+
+#include <llvm/Transforms/Utils/DataflowAnalyses.hpp>
+#include <llvm/Transforms/Utils/DataflowOpts.hpp>
+
+#include <vector>
+
+using namespace llvm;
+
+namespace secondAssignment {
+
+namespace {
+
+/// Scoped table mapping every expression id to the instruction computing it
+/// in the dominator tree path currently being visited. Lookup and insertion
+/// are a vector access; leaving a dominator subtree pops its entries.
+class LeaderTable {
+public:
+  Instruction *lookup(unsigned Id) const {
+    return Id < Leaders.size() ? Leaders[Id] : nullptr;
+  }
+
+  void insert(unsigned Id, Instruction *I) {
+    if (Id >= Leaders.size())
+      Leaders.resize(Id + 1, nullptr);
+    Leaders[Id] = I;
+    Scoped.push_back(Id);
+  }
+
+  size_t getScopeMark() const { return Scoped.size(); }
+
+  void popScope(size_t Mark) {
+    while (Scoped.size() > Mark)
+      Leaders[Scoped.pop_back_val()] = nullptr;
+  }
+
+private:
+  std::vector<Instruction *> Leaders;
+  SmallVector<unsigned, 32> Scoped;
+};
+
+} // namespace
+
+/// Replaces the recomputations of an expression with the dominating value.
+/// In SSA form a dominating evaluation of the same expression is always
+/// available, since operands cannot change in between. Expressions are
+/// hash-consed while walking, so that the users of a replaced instruction
+/// (visited later, being dominated by it) already see the leader as operand
+/// and chains of redundant expressions are removed in a single walk.
+///
+/// @param F Reference to the function to optimize.
+/// @param FAM Reference to the function analysis manager.
+/// @return The analyses preserved: the CFG is never modified, and cached
+/// dataflow results are updated incrementally.
+PreservedAnalyses GlobalCSEPass::run(Function &F,
+                                     FunctionAnalysisManager &FAM) {
+  auto &DT = FAM.getResult<DominatorTreeAnalysis>(F);
+  auto Tracked = getCachedDataflowResults(F, FAM);
+
+  ExpressionDomain Expressions;
+  LeaderTable Leaders;
+  bool Changed = false;
+
+  auto VisitBlock = [&](BasicBlock &BB) {
+    for (Instruction &I : make_early_inc_range(BB)) {
+      if (!ExpressionDomain::isCandidate(I))
+        continue;
+
+      unsigned Id = Expressions.getOrInsert(I).first;
+      Instruction *Leader = Leaders.lookup(Id);
+      if (!Leader) {
+        Leaders.insert(Id, &I);
+        continue;
+      }
+
+      // The leader now stands for both computations, so it may only keep the
+      // poison-generating flags (nsw, exact, ...) they have in common.
+      Leader->andIRFlags(&I);
+      for (auto *Analysis : Tracked)
+        Analysis->instructionWillBeReplaced(I);
+      Expressions.forget(&I);
+      I.replaceAllUsesWith(Leader);
+      I.eraseFromParent();
+      Changed = true;
+    }
+  };
+
+  struct Frame {
+    DomTreeNode *Node;
+    DomTreeNode::iterator NextChild;
+    size_t ScopeMark;
+  };
+  SmallVector<Frame, 16> Stack;
+  auto Enter = [&](DomTreeNode *Node) {
+    Stack.push_back({Node, Node->begin(), Leaders.getScopeMark()});
+    VisitBlock(*Node->getBlock());
+  };
+
+  Enter(DT.getRootNode());
+  while (!Stack.empty()) {
+    Frame &Top = Stack.back();
+    if (Top.NextChild != Top.Node->end()) {
+      Enter(*Top.NextChild++);
+      continue;
+    }
+    Leaders.popScope(Top.ScopeMark);
+    Stack.pop_back();
+  }
+
+  if (!Changed)
+    return PreservedAnalyses::all();
+
+  for (auto *Analysis : Tracked)
+    Analysis->update();
+
+  PreservedAnalyses PA;
+  PA.preserveSet<CFGAnalyses>();
+  preserveDataflowResults(PA);
+  return PA;
+}
+
+} // namespace secondAssignment
@@ -0,0 +1,296 @@
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/Analysis/ValueTracking.h>
+#include <llvm/IR/BasicBlock.h>
+#include <llvm/IR/CFG.h>
+#include <llvm/IR/InstIterator.h>
+#include <llvm/IR/Instruction.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/PassManager.h>
+#include <llvm/Transforms/Utils/BasicBlockUtils.h>
+#include <llvm/Transforms/Utils/Local.h>
+#include <llvm/Transforms/Utils/SSAUpdater.h>
+
+#include <llvm/Transforms/Utils/DataflowAnalyses.hpp>
+#include <llvm/Transforms/Utils/DataflowOpts.hpp>
+
+#include <memory>
+#include <utility>
+#include <vector>
+
+using namespace llvm;
+
+namespace secondAssignment {
+
+namespace {
+
+/// One of the auxiliary problems of lazy code motion. Their transfer
+/// functions are built from the results of the previous problems, so the Gen
+/// and Kill sets of every block are filled in by the pass before solving.
+class LazyCodeMotionProblem : public DataflowAnalysis {
+public:
+  LazyCodeMotionProblem(DataflowDirection Direction, MeetOperator Meet,
+                        const ExpressionDomain &Domain)
+      : DataflowAnalysis(Direction, Meet), Domain(Domain) {}
+
+  void setTransfer(const BasicBlock &BB, BitVector Gen, BitVector Kill) {
+    Transfer[&BB] = {std::move(Gen), std::move(Kill)};
+  }
+
+protected:
+  unsigned getDomainSize() const override { return Domain.size(); }
+
+  void computeGenKill(const BasicBlock &BB, BitVector &Gen,
+                      BitVector &Kill) override {
+    const auto &Sets = Transfer.find(&BB)->second;
+    Gen = Sets.first;
+    Kill = Sets.second;
+  }
+
+  void printFact(raw_ostream &OS, unsigned Id) const override {
+    Domain.print(OS, Id);
+  }
+
+private:
+  const ExpressionDomain &Domain;
+  DenseMap<const BasicBlock *, std::pair<BitVector, BitVector>> Transfer;
+};
+
+/// Copies a dataflow set, trimmed or extended to the size of the domain, so
+/// that complements do not set padding bits.
+BitVector fitToDomain(const BitVector &Set, unsigned Size) {
+  BitVector Result = Set;
+  Result.resize(Size);
+  return Result;
+}
+
+/// Puts an empty block on every edge entering a block with several
+/// predecessors, so that a computation can be placed on an edge rather than
+/// at the join, where it would also run along the paths that already have it.
+///
+/// @param F Reference to the function to modify.
+/// @return The blocks created on the edges.
+SmallVector<BasicBlock *, 16> splitEdgesIntoJoins(Function &F) {
+  SmallVector<std::pair<BasicBlock *, BasicBlock *>, 16> Edges;
+  for (BasicBlock &BB : F) {
+    if (BB.hasNPredecessorsOrMore(2) && !BB.isEHPad()) {
+      for (BasicBlock *Pred : predecessors(&BB)) {
+        const Instruction *Term = Pred->getTerminator();
+        if (isa<BranchInst>(Term) || isa<SwitchInst>(Term))
+          Edges.push_back({Pred, &BB});
+      }
+    }
+  }
+
+  SmallVector<BasicBlock *, 16> EdgeBlocks;
+  for (auto [From, To] : Edges) {
+    // A switch may reach the same block through several cases: the first
+    // split already covered all of them.
+    if (!is_contained(successors(From), To))
+      continue;
+    if (BasicBlock *EdgeBlock = SplitEdge(From, To))
+      EdgeBlocks.push_back(EdgeBlock);
+  }
+  return EdgeBlocks;
+}
+
+/// Folds the edge blocks back into the control flow graph: blocks split from
+/// a predecessor with a single successor are merged into it, and the blocks
+/// on critical edges that did not receive any computation are removed.
+///
+/// @param EdgeBlocks The blocks created by splitEdgesIntoJoins.
+void foldEdgeBlocks(ArrayRef<BasicBlock *> EdgeBlocks) {
+  for (BasicBlock *EdgeBlock : EdgeBlocks) {
+    BasicBlock *Pred = EdgeBlock->getSinglePredecessor();
+    if (Pred && Pred->getSingleSuccessor() == EdgeBlock)
+      MergeBlockIntoPredecessor(EdgeBlock);
+    else if (&EdgeBlock->front() == EdgeBlock->getTerminator())
+      TryToSimplifyUncondBranchFromEmptyBlock(EdgeBlock);
+  }
+}
+
+} // namespace
+
+/// Runs the four dataflow problems of lazy code motion, in the block-level
+/// formulation of the Dragon Book (section 9.5):
+///   1. anticipated expressions, i.e. the very busy expressions of Assignment2;
+///   2. "will be available" expressions, forward and intersection, with
+///      Gen = anticipated.in - e_kill, Kill = e_kill; then
+///      earliest = anticipated.in - available.in;
+///   3. postponable expressions, forward and intersection, with
+///      Gen = earliest - e_use, Kill = e_use; then
+///      latest = (earliest ∪ postponable.in) ∩
+///               (e_use ∪ ¬∩succ(earliest ∪ postponable.in));
+///   4. used expressions, backward and union, with Gen = e_use - latest,
+///      Kill = latest.
+/// An expression is then computed at the entry of the blocks in
+/// latest ∩ used.out, and its upward exposed evaluations in the blocks in
+/// e_use ∩ (¬latest ∪ used.out) are replaced with the placed value. In SSA
+/// form several placements may reach the same evaluation, so the uses are
+/// rewritten through SSAUpdater, which adds the phis joining them.
+///
+/// Only expressions that are safe to speculate take part: lazy code motion
+/// never adds an evaluation to a path, but it may move a division by zero
+/// before a call that would not have returned.
+///
+/// @param F Reference to the function to optimize.
+/// @param FAM Reference to the function analysis manager.
+/// @return The analyses preserved: none, when the function was modified.
+PreservedAnalyses LazyCodeMotionPass::run(Function &F,
+                                          FunctionAnalysisManager &FAM) {
+  bool HasCandidates = any_of(instructions(F), [](const Instruction &I) {
+    return ExpressionDomain::isCandidate(I);
+  });
+  if (!HasCandidates)
+    return PreservedAnalyses::all();
+
+  SmallVector<BasicBlock *, 16> EdgeBlocks = splitEdgesIntoJoins(F);
+
+  VeryBusyExpressions Anticipated;
+  Anticipated.solve(F);
+  const ExpressionDomain &Domain = Anticipated.getDomain();
+  unsigned Size = Domain.size();
+
+  // Upward exposed evaluations of every block, the only ones lazy code motion
+  // may replace. Their ids are recorded now, since rewriting the operands of
+  // an evaluation changes the key it would be looked up with.
+  DenseMap<const BasicBlock *,
+           SmallVector<std::pair<Instruction *, unsigned>, 4>>
+      Evaluations;
+  std::vector<SmallVector<Instruction *, 4>> EvaluationsOf(Size);
+  BitVector Unsafe(Size);
+  for (BasicBlock &BB : F) {
+    for (Instruction &I : BB) {
+      auto Id = Domain.lookup(I);
+      if (!Id)
+        continue;
+      if (!isSafeToSpeculativelyExecute(&I))
+        Unsafe.set(*Id);
+      bool IsUpwardExposed = none_of(I.operands(), [&BB](const Use &U) {
+        auto *OperandInst = dyn_cast<Instruction>(U);
+        return OperandInst && OperandInst->getParent() == &BB;
+      });
+      if (IsUpwardExposed) {
+        Evaluations[&BB].push_back({&I, *Id});
+        EvaluationsOf[*Id].push_back(&I);
+      }
+    }
+  }
+
+  DenseMap<const BasicBlock *, BitVector> Uses, Kills, Earliest, Latest;
+  for (BasicBlock &BB : F) {
+    Uses[&BB] = fitToDomain(Anticipated.getGen(BB), Size);
+    Uses[&BB].reset(Unsafe);
+    Kills[&BB] = fitToDomain(Anticipated.getKill(BB), Size);
+  }
+
+  LazyCodeMotionProblem Available(DataflowDirection::Forward,
+                                  MeetOperator::Intersection, Domain);
+  for (BasicBlock &BB : F) {
+    BitVector Gen = fitToDomain(Anticipated.getIn(BB), Size);
+    Gen.reset(Kills[&BB]);
+    Available.setTransfer(BB, std::move(Gen), Kills[&BB]);
+  }
+  Available.solve(F);
+
+  for (BasicBlock &BB : F) {
+    BitVector Set = fitToDomain(Anticipated.getIn(BB), Size);
+    Set.reset(fitToDomain(Available.getIn(BB), Size));
+    Set.reset(Unsafe);
+    Earliest[&BB] = std::move(Set);
+  }
+
+  LazyCodeMotionProblem Postponable(DataflowDirection::Forward,
+                                    MeetOperator::Intersection, Domain);
+  for (BasicBlock &BB : F) {
+    BitVector Gen = Earliest[&BB];
+    Gen.reset(Uses[&BB]);
+    Postponable.setTransfer(BB, std::move(Gen), Uses[&BB]);
+  }
+  Postponable.solve(F);
+
+  auto EarliestOrPostponable = [&](const BasicBlock &BB) {
+    BitVector Set = fitToDomain(Postponable.getIn(BB), Size);
+    Set |= Earliest[&BB];
+    return Set;
+  };
+  for (BasicBlock &BB : F) {
+    BitVector NotPostponableInAllSuccessors(Size, true);
+    for (const BasicBlock *Succ : successors(&BB))
+      NotPostponableInAllSuccessors &= EarliestOrPostponable(*Succ);
+    NotPostponableInAllSuccessors.flip();
+    NotPostponableInAllSuccessors |= Uses[&BB];
+
+    BitVector Set = EarliestOrPostponable(BB);
+    Set &= NotPostponableInAllSuccessors;
+    Latest[&BB] = std::move(Set);
+  }
+
+  LazyCodeMotionProblem UsedLater(DataflowDirection::Backward,
+                                  MeetOperator::Union, Domain);
+  for (BasicBlock &BB : F) {
+    BitVector Gen = Uses[&BB];
+    Gen.reset(Latest[&BB]);
+    UsedLater.setTransfer(BB, std::move(Gen), Latest[&BB]);
+  }
+  UsedLater.solve(F);
+
+  // Place the computations. A placed instruction stands for every evaluation
+  // it may replace, so it keeps only the flags (nsw, exact, ...) they share.
+  bool Changed = false;
+  std::vector<std::unique_ptr<SSAUpdater>> Updaters(Size);
+  DenseMap<std::pair<const BasicBlock *, unsigned>, Instruction *> Placed;
+  for (BasicBlock &BB : F) {
+    BitVector Placements = fitToDomain(UsedLater.getOut(BB), Size);
+    Placements &= Latest[&BB];
+    for (unsigned Id : Placements.set_bits()) {
+      Instruction *Template = EvaluationsOf[Id].front();
+      Instruction *Computation = Template->clone();
+      Computation->setName(Template->getName() + ".lcm");
+      Computation->insertBefore(&*BB.getFirstInsertionPt());
+      for (Instruction *Evaluation : EvaluationsOf[Id])
+        Computation->andIRFlags(Evaluation);
+
+      if (!Updaters[Id]) {
+        Updaters[Id] = std::make_unique<SSAUpdater>();
+        Updaters[Id]->Initialize(Template->getType(), Template->getName());
+      }
+      Updaters[Id]->AddAvailableValue(&BB, Computation);
+      Placed[{&BB, Id}] = Computation;
+      Changed = true;
+    }
+  }
+
+  // Replace the evaluations that are now redundant.
+  for (BasicBlock &BB : F) {
+    auto It = Evaluations.find(&BB);
+    if (It == Evaluations.end())
+      continue;
+    const BitVector &UsedOut = UsedLater.getOut(BB);
+    for (auto [Evaluation, Id] : It->second) {
+      if (Unsafe.test(Id))
+        continue;
+      bool IsUsedLater = Id < UsedOut.size() && UsedOut.test(Id);
+      if (Latest[&BB].test(Id) && !IsUsedLater)
+        continue;
+
+      Value *Replacement = Placed.lookup({&BB, Id});
+      assert((Replacement || Updaters[Id]) &&
+             "Replaced evaluation not reached by any placement");
+      if (!Replacement)
+        Replacement = Updaters[Id]->GetValueInMiddleOfBlock(&BB);
+      Evaluation->replaceAllUsesWith(Replacement);
+      Evaluation->eraseFromParent();
+      Changed = true;
+    }
+  }
+
+  foldEdgeBlocks(EdgeBlocks);
+
+  if (!Changed && EdgeBlocks.empty())
+    return PreservedAnalyses::all();
+  return PreservedAnalyses::none();
+}
+
+} // namespace secondAssignment
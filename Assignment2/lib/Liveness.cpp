@@ -0,0 +1,155 @@
+#include <llvm/IR/BasicBlock.h>
+#include <llvm/IR/CFG.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/PassManager.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <llvm/Transforms/Utils/DataflowAnalyses.hpp>
+
+using namespace llvm;
+
+namespace secondAssignment {
+
+/// Arguments and value-producing instructions are the values that may need
+/// a register; constants, globals and basic blocks do not take part.
+///
+/// @param V Reference to the value to check.
+/// @return True if V belongs to the domain.
+bool ValueDomain::isCandidate(const Value &V) {
+  if (isa<Argument>(V))
+    return true;
+  return isa<Instruction>(V) && !V.getType()->isVoidTy();
+}
+
+/// @param V The value to look up.
+/// @return The id of V, if it is in the domain.
+std::optional<unsigned> ValueDomain::lookup(const Value *V) const {
+  auto It = Ids.find(V);
+  if (It == Ids.end())
+    return std::nullopt;
+  return It->second;
+}
+
+/// @param V A candidate value.
+/// @return The id of V and true if it has just been numbered.
+std::pair<unsigned, bool> ValueDomain::getOrInsert(const Value *V) {
+  auto [It, Inserted] = Ids.try_emplace(V, Values.size());
+  if (Inserted)
+    Values.push_back(V);
+  return {It->second, Inserted};
+}
+
+/// Forgets a value about to be erased; its id is never reused.
+void ValueDomain::forget(const Value *V) {
+  auto It = Ids.find(V);
+  if (It == Ids.end())
+    return;
+  Values[It->second] = nullptr;
+  Ids.erase(It);
+}
+
+Liveness::Liveness()
+    : DataflowAnalysis(DataflowDirection::Backward, MeetOperator::Union) {}
+
+/// Numbers the arguments first, then every value-producing instruction.
+void Liveness::buildDomain(Function &F) {
+  Domain = ValueDomain();
+  for (auto &Arg : F.args())
+    Domain.getOrInsert(&Arg);
+  for (auto &BB : F)
+    for (auto &I : BB)
+      if (ValueDomain::isCandidate(I))
+        Domain.getOrInsert(&I);
+}
+
+/// Numbers a value. A value numbered only now (an edit created it) must be
+/// killed by its defining block, which is therefore marked dirty.
+///
+/// @param V The value to number.
+/// @return Its id, or nothing if V does not need a register.
+std::optional<unsigned> Liveness::intern(const Value *V) {
+  if (!ValueDomain::isCandidate(*V))
+    return std::nullopt;
+
+  auto [Id, Inserted] = Domain.getOrInsert(V);
+  if (Inserted)
+    if (auto *I = dyn_cast<Instruction>(V))
+      markDirty(I->getParent());
+  return Id;
+}
+
+/// Gen contains the values used in the block before (or without) being
+/// defined there, including the phi operands flowing along its outgoing
+/// edges. Kill contains the values defined in the block.
+///
+/// @param BB Reference to the basic block.
+/// @param Gen Output set of upward exposed uses.
+/// @param Kill Output set of definitions.
+void Liveness::computeGenKill(const BasicBlock &BB, BitVector &Gen,
+                              BitVector &Kill) {
+  auto AddUse = [&](const Value *V) {
+    auto *I = dyn_cast<Instruction>(V);
+    if (I && I->getParent() == &BB)
+      return;
+    if (auto Id = intern(V))
+      addFact(Gen, *Id);
+  };
+
+  for (const Instruction &I : BB) {
+    if (!isa<PHINode>(I))
+      for (const Value *Operand : I.operands())
+        AddUse(Operand);
+    if (auto Id = intern(&I))
+      addFact(Kill, *Id);
+  }
+
+  for (const BasicBlock *Succ : successors(&BB))
+    for (const PHINode &Phi : Succ->phis())
+      AddUse(Phi.getIncomingValueForBlock(&BB));
+}
+
+/// @param BB Reference to the basic block.
+/// @return The values holding a register at the terminator of BB.
+BitVector Liveness::getLiveOut(const BasicBlock &BB) const {
+  BitVector LiveOut = getOut(BB);
+  for (const BasicBlock *Succ : successors(&BB)) {
+    for (const PHINode &Phi : Succ->phis()) {
+      if (auto Id = Domain.lookup(Phi.getIncomingValueForBlock(&BB))) {
+        if (*Id >= LiveOut.size())
+          LiveOut.resize(*Id + 1);
+        LiveOut.set(*Id);
+      }
+    }
+  }
+  return LiveOut;
+}
+
+void Liveness::valueWillBeErased(const Value &V) { Domain.forget(&V); }
+
+void Liveness::printFact(raw_ostream &OS, unsigned Id) const {
+  if (const Value *V = Domain.getValue(Id))
+    V->printAsOperand(OS, false);
+  else
+    OS << "<erased>";
+}
+
+AnalysisKey LivenessAnalysis::Key;
+
+/// Computes the liveness of a function from scratch.
+///
+/// @param F Reference to the function to analyze.
+/// @return The solved analysis, ready to be updated incrementally.
+Liveness LivenessAnalysis::run(Function &F, FunctionAnalysisManager &) {
+  Liveness Result;
+  Result.solve(F);
+  return Result;
+}
+
+PreservedAnalyses LivenessPrinterPass::run(Function &F,
+                                           FunctionAnalysisManager &FAM) {
+  OS << "Live values for function '" << F.getName() << "':\n";
+  FAM.getResult<LivenessAnalysis>(F).print(OS);
+  return PreservedAnalyses::all();
+}
+
+} // namespace secondAssignment
@@ -0,0 +1,59 @@
+#include <llvm/IR/BasicBlock.h>
+#include <llvm/IR/Instruction.h>
+#include <llvm/IR/PassManager.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <llvm/Transforms/Utils/DataflowAnalyses.hpp>
+
+using namespace llvm;
+
+namespace secondAssignment {
+
+VeryBusyExpressions::VeryBusyExpressions()
+    : ExpressionDataflowAnalysis(DataflowDirection::Backward,
+                                 MeetOperator::Intersection) {}
+
+/// Gen contains the upward exposed expressions of the block, i.e. those whose
+/// operands are not defined earlier in the same block. Kill contains every
+/// expression using a value defined in the block.
+///
+/// @param BB Reference to the basic block.
+/// @param Gen Output set of generated expressions.
+/// @param Kill Output set of killed expressions.
+void VeryBusyExpressions::computeGenKill(const BasicBlock &BB, BitVector &Gen,
+                                         BitVector &Kill) {
+  for (const Instruction &I : BB) {
+    if (auto Id = intern(I)) {
+      bool IsUpwardExposed = llvm::none_of(I.operands(), [&BB](const Use &U) {
+        auto *OperandInst = dyn_cast<Instruction>(U);
+        return OperandInst && OperandInst->getParent() == &BB;
+      });
+      if (IsUpwardExposed)
+        addFact(Gen, *Id);
+    }
+    addKilledExpressions(I, Kill);
+  }
+}
+
+AnalysisKey VeryBusyExpressionsAnalysis::Key;
+
+/// Computes the very busy expressions of a function from scratch.
+///
+/// @param F Reference to the function to analyze.
+/// @return The solved analysis, ready to be updated incrementally.
+VeryBusyExpressions
+VeryBusyExpressionsAnalysis::run(Function &F, FunctionAnalysisManager &) {
+  VeryBusyExpressions Result;
+  Result.solve(F);
+  return Result;
+}
+
+PreservedAnalyses
+VeryBusyExpressionsPrinterPass::run(Function &F,
+                                    FunctionAnalysisManager &FAM) {
+  OS << "Very busy expressions for function '" << F.getName() << "':\n";
+  FAM.getResult<VeryBusyExpressionsAnalysis>(F).print(OS);
+  return PreservedAnalyses::all();
+}
+
+} // namespace secondAssignment
@@ -0,0 +1,32 @@
+; RUN: opt -passes='require<liveness>,global-cse,print<liveness>' \
+; RUN:   -disable-output < %s 2>&1 | FileCheck %s
+
+; Global CSE replaces %y with %x while liveness is cached. %y reaches the phi
+; through %then, which neither defines %y nor holds the phi: the update must
+; still make %x live at the end of %then, as a full solve does.
+
+; CHECK-LABEL: Live values for function 'phi':
+; CHECK:       %mid
+; CHECK-NEXT:    IN:  { %d, %x }
+; CHECK-NEXT:    OUT: { %x }
+; CHECK-NEXT:  %then
+; CHECK-NEXT:    IN:  { %x }
+; CHECK-NEXT:    OUT: { }
+; CHECK-NOT:   <erased>
+
+define i32 @phi(i32 %a, i32 %b, i1 %c, i1 %d) {
+entry:
+  %x = add i32 %a, %b
+  br i1 %c, label %mid, label %join
+
+mid:
+  %y = add i32 %a, %b
+  br i1 %d, label %then, label %join
+
+then:
+  br label %join
+
+join:
+  %p = phi i32 [ %x, %entry ], [ %y, %mid ], [ %y, %then ]
+  ret i32 %p
+}
@@ -1649,7 +1649,8 @@ Error PassBuilder::parseFunctionPass(FunctionPassManager &FPM,
       // Add the nested pass manager with the appropriate adaptor.
       bool UseMemorySSA = (Name == "loop-mssa");
       bool UseBFI = llvm::any_of(InnerPipeline, [](auto Pipeline) {
-        return Pipeline.Name.contains("simple-loop-unswitch");
+        return Pipeline.Name.contains("simple-loop-unswitch") ||
+               Pipeline.Name == "custom-licm";
       });
       bool UseBPI = llvm::any_of(InnerPipeline, [](auto Pipeline) {
         return Pipeline.Name == "loop-predication";
@@ -1,46 +1,182 @@
 #ifndef LLVM_TRANSFORMS_UTILS_LOOPINVARIANTHOISTPASS_HPP
 #define LLVM_TRANSFORMS_UTILS_LOOPINVARIANTHOISTPASS_HPP
 
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/AssumptionCache.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
 #include "llvm/Analysis/LoopAnalysisManager.h"
+#include "llvm/Analysis/LoopNestAnalysis.h"
+#include "llvm/Analysis/MemorySSA.h"
+#include "llvm/Analysis/MemorySSAUpdater.h"
+#include "llvm/Analysis/MustExecute.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
 #include "llvm/IR/Dominators.h"
 #include "llvm/IR/PassManager.h"
+#include "llvm/IR/ValueHandle.h"
 #include "llvm/Transforms/Scalar/LoopPassManager.h"
+#include "llvm/Transforms/Utils/DataflowAnalyses.hpp"
 #include "llvm/Transforms/Utils/LoopUtils.h"
-#include <map>
-#include <set>
+#include <optional>
 #include <vector>
 
 namespace llvm {
 
+// State of LoopInvariantHoistPass for the loop being optimized. Instructions
+// are numbered densely in block order, so every set is a bit vector indexed
+// by number. reset() forgets the previous loop but keeps the capacity of the
+// arrays and bit vectors, which only grow for a loop larger than any before
+// it; the map from instructions to numbers is rebuilt for every loop.
+class LoopInvariantState {
+public:
+  void reset(Loop &loop);
+
+  unsigned size() const { return instructions.size(); }
+  std::optional<unsigned> getNumber(const Instruction *I) const;
+  Instruction *getInstruction(unsigned number) const {
+    return instructions[number];
+  }
+
+  bool isInvariant(unsigned number) const { return invariant.test(number); }
+  void markInvariant(unsigned number);
+  // Invariant instructions in discovery order: every instruction comes after
+  // its invariant operands.
+  ArrayRef<unsigned> getInvariantOrder() const {
+    return invariantOrder;
+  }
+
+  bool isHoistable(unsigned number) const { return hoistable.test(number); }
+  bool isNonHoistable(unsigned number) const {
+    return nonHoistable.test(number);
+  }
+  void markHoistable(unsigned number, const char *reason);
+  void markNonHoistable(unsigned number, const char *reason);
+  bool hasHoistable() const { return hoistable.any(); }
+  // Hoistable instructions that may only run when the loop is entered: they
+  // are moved to a block guarded by the loop's entry test.
+  bool isGuarded(unsigned number) const { return guarded.test(number); }
+  void markGuarded(unsigned number) { guarded.set(number); }
+  bool hasGuarded() const { return guarded.any(); }
+  // Instructions whose value is only used after the loop: they are moved to
+  // the exit blocks.
+  bool isSinkable(unsigned number) const { return sinkable.test(number); }
+  void markSinkable(unsigned number, const char *reason);
+  const char *getReason(unsigned number) const { return reasons[number]; }
+
+  void addExitingBlock(BasicBlock *BB) { exitingBlocks.push_back(BB); }
+  ArrayRef<BasicBlock *> getExitingBlocks() const { return exitingBlocks; }
+  // Instructions of the loop that may write to memory.
+  ArrayRef<Instruction *> getMemoryWriters() const { return memoryWriters; }
+
+private:
+  DenseMap<const Instruction *, unsigned> numbers;
+  SmallVector<Instruction *, 0> instructions;
+  SmallVector<unsigned, 0> invariantOrder;
+  SmallVector<const char *, 0> reasons;
+  BitVector invariant, hoistable, nonHoistable, guarded, sinkable;
+  SmallVector<BasicBlock *, 8> exitingBlocks;
+  SmallVector<Instruction *, 8> memoryWriters;
+};
+
+// Sets a flag once the value it watches is erased.
+class ErasureWatch final : public CallbackVH {
+public:
+  ErasureWatch(Value *value, bool *erased)
+      : CallbackVH(value), erased(erased) {}
+
+private:
+  bool *erased;
+
+  void deleted() override {
+    *erased = true;
+    setValPtr(nullptr);
+  }
+};
+
 class LoopInvariantHoistPass : public PassInfoMixin<LoopInvariantHoistPass> {
 public:
   PreservedAnalyses run(Loop &L, LoopAnalysisManager &AM,
                         LoopStandardAnalysisResults &AR, LPMUpdater &U);
   bool runOnLoop(Loop *L, LoopAnalysisManager &AM,
-                 LoopStandardAnalysisResults &AR);
+                 LoopStandardAnalysisResults &AR, LPMUpdater &U);
   void analyze(Loop *L, LoopAnalysisManager &AM,
                LoopStandardAnalysisResults &AR);
 
 private:
   Loop *currentLoop;
+  LoopInfo *loopInfo;
   DominatorTree *dominatorTree;
+  const TargetTransformInfo *targetInfo;
+  AAResults *aliasAnalysis;
+  AssumptionCache *assumptions;
+  MemorySSA *memorySSA;
+  MemorySSAUpdater *memorySSAUpdater;
+  ScalarEvolution *scalarEvolution;
+  BlockFrequencyInfo *blockFrequencies;
+  OptimizationRemarkEmitter *remarks;
+  ICFLoopSafetyInfo safetyInfo;
+  // Liveness of the last function visited, shared by its loops, and the
+  // blocks and values it refers to.
+  secondAssignment::Liveness functionLiveness;
+  const Function *livenessFunction = nullptr;
+  size_t livenessBlocks = 0, livenessInstructions = 0;
+  bool livenessErased = false;
+  std::vector<ErasureWatch> livenessWatches;
 
-  std::set<Instruction *> loopInvariantInstructions;
-  std::vector<Instruction *> invariantInstructionsOrder;
-  std::set<Instruction *> hoistableInstructions;
-  std::set<Instruction *> nonHoistableInstructions;
-
-  std::map<Instruction *, std::string> hoistReasons;
-  std::map<Instruction *, std::string> nonHoistReasons;
-
-  std::set<BasicBlock *> loopExitingBlocks;
+  LoopInvariantState state;
 
   void identifyLoopInvariantInstructionsAndExitingBlocks();
+  unsigned countHoistableMissedByBlockOrder() const;
   bool isOperandInvariant(const Use &operand) const;
   bool isLoopInvariant(const Instruction &instruction) const;
+  bool isLoadInvariant(const LoadInst &load) const;
+  bool isCallHoistable(const CallBase &call) const;
+  bool isCallInvariant(const CallBase &call) const;
   void determineHoistableInstructions();
+  bool isSafeToSpeculate(const Instruction &instruction) const;
+  bool canHoistUnderGuard(const Instruction &instruction) const;
+  Value *getLoopGuard(Instruction *insertBefore) const;
+  Value *getValueOnLoopEntry(Value *value, Instruction *insertBefore,
+                             DenseMap<Value *, Value *> &entryValues) const;
+  BasicBlock *hoistUnderGuard(BasicBlock *preheader);
+  void determineSinkableInstructions();
+  bool canSink(const Instruction &instruction) const;
+  bool sinkToExitBlocks();
+  bool sinkInstruction(Instruction &instruction);
+  Value *getExitValue(Instruction *value, BasicBlock *exitBlock) const;
   bool isLoopExiting(const BasicBlock *basicBlock);
-  void printAnalysisResult();
+  bool hasLoadBlockedByAliasing() const;
+  bool versionForNoAlias(const TargetLibraryInfo &libraryInfo, LPMUpdater &U);
+  void applyBlockFrequencies();
+  void reportHoistingSavings(BasicBlock *preheader);
+  const secondAssignment::Liveness &getFunctionLiveness(Function &function);
+  void applyRegisterBudget();
+  SmallDenseMap<unsigned, unsigned, 4>
+  estimateRegisterPressure(const secondAssignment::Liveness &liveness) const;
+  unsigned getRegisterClass(const Value *value) const;
+  unsigned getRegisterBudget(unsigned registerClass) const;
+  void emitAnalysisRemarks() const;
+  void emitMovedRemark(StringRef remarkName, StringRef action,
+                       const Instruction &instruction, StringRef reason) const;
+  bool promoteMemoryToRegisters(BasicBlock *preheader);
+  bool canPromote(Value *pointer, ArrayRef<Instruction *> accesses);
+  void promote(Value *pointer, ArrayRef<Instruction *> accesses,
+               BasicBlock *preheader);
+};
+
+// Loop nest mode of custom-licm: every instruction is moved straight to the
+// outermost loop level where it is invariant, in a single traversal of the
+// whole nest, instead of one level per run of the loop pass.
+class LoopNestInvariantHoistPass
+    : public PassInfoMixin<LoopNestInvariantHoistPass> {
+public:
+  PreservedAnalyses run(LoopNest &LN, LoopAnalysisManager &AM,
+                        LoopStandardAnalysisResults &AR, LPMUpdater &U);
 };
 
 } // end namespace llvm
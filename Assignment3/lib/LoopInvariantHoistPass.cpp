@@ -1,57 +1,287 @@
+#include <llvm/ADT/MapVector.h>
+#include <llvm/ADT/Statistic.h>
+#include <llvm/Analysis/LoopAccessAnalysis.h>
 #include <llvm/Analysis/LoopInfo.h>
+#include <llvm/Analysis/LoopIterator.h>
+#include <llvm/Analysis/MemoryLocation.h>
+#include <llvm/Analysis/OptimizationRemarkEmitter.h>
+#include <llvm/Analysis/ValueTracking.h>
 #include <llvm/IR/Dominators.h>
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/Instruction.h>
+#include <llvm/IR/Instructions.h>
 #include <llvm/IR/PassManager.h>
 #include <llvm/IR/Use.h>
-#include <llvm/Support/raw_ostream.h>
-#include <unordered_set>
-#include <vector>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/FormatVariadic.h>
+#include <llvm/Transforms/Utils/BasicBlockUtils.h>
+#include <llvm/Transforms/Utils/LoopVersioning.h>
+#include <llvm/Transforms/Utils/SSAUpdater.h>
+#include <algorithm>
+#include <optional>
 
+#include "llvm/Transforms/Utils/DataflowAnalyses.hpp"
 #include "llvm/Transforms/Utils/LoopInvariantHoistPass.hpp"
 
 using namespace llvm;
+using secondAssignment::Liveness;
+using secondAssignment::ValueDomain;
+
+static cl::opt<bool> GuardedHoisting(
+    "custom-licm-guarded-hoisting", cl::init(false), cl::Hidden,
+    cl::desc("Hoist instructions that may trap under a copy of the loop's "
+             "entry test"));
+
+static cl::opt<bool> LoopVersioningEnabled(
+    "custom-licm-versioning", cl::init(true), cl::Hidden,
+    cl::desc("Version loops under runtime alias checks to hoist and promote "
+             "the loads that other pointers may alias"));
+
+#define DEBUG_TYPE "custom-licm"
+
+STATISTIC(NumHoisted, "Number of instructions hoisted");
+STATISTIC(NumNestLevelsSkipped,
+          "Number of loop levels crossed at once by the loop nest mode");
+STATISTIC(NumDynamicInstructionsSaved,
+          "Number of dynamic instructions saved in the profiled run");
+STATISTIC(NumFoundByWorklist,
+          "Number of invariant instructions found after the RPO sweep");
+STATISTIC(NumGuarded, "Number of instructions hoisted under the loop guard");
+STATISTIC(NumSunk, "Number of instructions sunk to the exit blocks");
+STATISTIC(NumVersioned, "Number of loops versioned under runtime alias checks");
+STATISTIC(NumPromoted, "Number of memory locations promoted to registers");
+STATISTIC(NumHoistedMissedByBlockOrder,
+          "Number of hoisted instructions a single scan in block order misses");
+
+static cl::opt<unsigned> RegisterBudgetOverride(
+    "custom-licm-register-budget", cl::init(0), cl::Hidden,
+    cl::desc("Registers of each class custom-licm may keep busy across a "
+             "loop (0 asks the target)"));
+
+void LoopInvariantState::reset(Loop &loop) {
+  numbers.clear();
+  instructions.clear();
+  invariantOrder.clear();
+  reasons.clear();
+  exitingBlocks.clear();
+  memoryWriters.clear();
+
+  unsigned count = 0;
+  for (auto *BB : loop.getBlocks())
+    count += BB->size();
+
+  numbers.reserve(count);
+  instructions.reserve(count);
+  invariantOrder.reserve(count);
+  reasons.assign(count, nullptr);
+
+  unsigned number = 0;
+  for (auto *BB : loop.getBlocks()) {
+    for (auto &I : *BB) {
+      numbers[&I] = number++;
+      instructions.push_back(&I);
+      if (I.mayWriteToMemory())
+        memoryWriters.push_back(&I);
+    }
+  }
+
+  for (BitVector *set : {&invariant, &hoistable, &nonHoistable, &guarded,
+                          &sinkable}) {
+    set->clear();
+    set->resize(count);
+  }
+}
+
+std::optional<unsigned>
+LoopInvariantState::getNumber(const Instruction *I) const {
+  auto it = numbers.find(I);
+  if (it == numbers.end())
+    return std::nullopt;
+  return it->second;
+}
+
+void LoopInvariantState::markInvariant(unsigned number) {
+  if (invariant.test(number))
+    return;
+  invariant.set(number);
+  invariantOrder.push_back(number);
+}
+
+void LoopInvariantState::markHoistable(unsigned number, const char *reason) {
+  hoistable.set(number);
+  nonHoistable.reset(number);
+  reasons[number] = reason;
+}
+
+void LoopInvariantState::markNonHoistable(unsigned number,
+                                          const char *reason) {
+  hoistable.reset(number);
+  nonHoistable.set(number);
+  guarded.reset(number);
+  reasons[number] = reason;
+}
+
+void LoopInvariantState::markSinkable(unsigned number, const char *reason) {
+  sinkable.set(number);
+  nonHoistable.reset(number);
+  reasons[number] = reason;
+}
 
 void LoopInvariantHoistPass::analyze(Loop *loop, LoopAnalysisManager &AM,
                                      LoopStandardAnalysisResults &AR) {
+  state.reset(*loop);
+  safetyInfo.computeLoopSafetyInfo(loop);
   identifyLoopInvariantInstructionsAndExitingBlocks();
   determineHoistableInstructions();
-  printAnalysisResult();
+  applyBlockFrequencies();
+  applyRegisterBudget();
+  determineSinkableInstructions();
+  emitAnalysisRemarks();
 }
 
+// Blocks are swept in reverse post-order, so operands are usually classified
+// before their users. Whenever an instruction becomes invariant its users
+// that are not (yet) invariant are queued and checked again, until nothing
+// changes: the result does not depend on the order of the loop's blocks.
 void LoopInvariantHoistPass::
     identifyLoopInvariantInstructionsAndExitingBlocks() {
-  for (auto *BB : currentLoop->getBlocks()) {
+  SmallVector<unsigned, 16> worklist;
+  auto markInvariant = [&](Instruction &I, unsigned number) {
+    state.markInvariant(number);
+    for (auto *U : I.users()) {
+      auto userNumber = state.getNumber(dyn_cast<Instruction>(U));
+      if (userNumber && !state.isInvariant(*userNumber))
+        worklist.push_back(*userNumber);
+    }
+  };
+
+  LoopBlocksRPO RPO(currentLoop);
+  RPO.perform(loopInfo);
+  for (auto *BB : RPO) {
     for (auto &I : *BB) {
       if (isLoopInvariant(I)) {
-        loopInvariantInstructions.insert(&I);
-        invariantInstructionsOrder.push_back(&I);
+        markInvariant(I, *state.getNumber(&I));
       }
     }
 
     if (isLoopExiting(BB)) {
-      loopExitingBlocks.insert(BB);
+      state.addExitingBlock(BB);
     }
   }
+
+  unsigned foundBySweep = state.getInvariantOrder().size();
+  while (!worklist.empty()) {
+    unsigned number = worklist.pop_back_val();
+    Instruction *I = state.getInstruction(number);
+    if (!state.isInvariant(number) && isLoopInvariant(*I))
+      markInvariant(*I, number);
+  }
+  NumFoundByWorklist += state.getInvariantOrder().size() - foundBySweep;
+}
+
+// Hoistable instructions that a single scan of the blocks in list order would
+// not have recognized: those with an invariant operand numbered after them
+// (numbers follow the block list) or depending on such an instruction.
+unsigned LoopInvariantHoistPass::countHoistableMissedByBlockOrder() const {
+  BitVector missed(state.size());
+  unsigned count = 0;
+  for (unsigned number : state.getInvariantOrder()) {
+    Instruction *I = state.getInstruction(number);
+    if (llvm::any_of(I->operands(), [&](const Use &U) {
+          auto operandNumber = state.getNumber(dyn_cast<Instruction>(U));
+          return operandNumber &&
+                 (*operandNumber > number || missed.test(*operandNumber));
+        })) {
+      missed.set(number);
+      if (state.isHoistable(number))
+        ++count;
+    }
+  }
+  return count;
 }
 
 bool LoopInvariantHoistPass::isOperandInvariant(const Use &U) const {
   if (isa<Constant>(U) || isa<Argument>(U))
     return true;
 
+  // Only the instructions of the loop are numbered.
   if (auto *Inst = dyn_cast<Instruction>(U)) {
-    return loopInvariantInstructions.count(Inst) ||
-           !currentLoop->contains(Inst);
+    auto number = state.getNumber(Inst);
+    return !number || state.isInvariant(*number);
   }
   return false;
 }
 
+// Instructions with side effects stay in the loop. Among those reading
+// memory only loads and read-only calls are considered, when nothing in the
+// loop writes to the memory they read.
 bool LoopInvariantHoistPass::isLoopInvariant(const Instruction &I) const {
-  if (isa<PHINode>(I))
+  if (isa<PHINode>(I) || isa<AllocaInst>(I) || I.isTerminator() ||
+      I.isEHPad())
+    return false;
+  auto *call = dyn_cast<CallBase>(&I);
+  if (call ? !isCallHoistable(*call) : I.mayHaveSideEffects())
     return false;
 
-  return llvm::all_of(I.operands(),
-                      [this](const Use &U) { return isOperandInvariant(U); });
+  if (!llvm::all_of(I.operands(),
+                    [this](const Use &U) { return isOperandInvariant(U); }))
+    return false;
+
+  if (auto *load = dyn_cast<LoadInst>(&I))
+    return isLoadInvariant(*load);
+  if (call)
+    return isCallInvariant(*call);
+  return !I.mayReadFromMemory();
+}
+
+// With MemorySSA the load is invariant if its clobbering access is outside
+// the loop; otherwise alias analysis checks it against every instruction of
+// the loop that may write to memory.
+bool LoopInvariantHoistPass::isLoadInvariant(const LoadInst &load) const {
+  if (!load.isUnordered())
+    return false;
+
+  if (memorySSA) {
+    MemoryAccess *clobber =
+        memorySSA->getWalker()->getClobberingMemoryAccess(&load);
+    return memorySSA->isLiveOnEntryDef(clobber) ||
+           !currentLoop->contains(clobber->getBlock());
+  }
+
+  MemoryLocation location = MemoryLocation::get(&load);
+  return llvm::none_of(state.getMemoryWriters(), [&](Instruction *writer) {
+    return isModSet(aliasAnalysis->getModRefInfo(writer, location));
+  });
+}
+
+// A call computes a value from its arguments and the memory it reads only if
+// its memory effects, from its attributes and what alias analysis knows of
+// the callee, are at most reads, and it returns normally. Calls producing no
+// value, as debug intrinsics, are only there for their effects.
+bool LoopInvariantHoistPass::isCallHoistable(const CallBase &call) const {
+  if (call.getType()->isVoidTy() || call.isConvergent() ||
+      call.hasOperandBundles() || call.mayThrow() || !call.willReturn())
+    return false;
+  return aliasAnalysis->getMemoryEffects(&call).onlyReadsMemory();
+}
+
+// A call that does not access memory is invariant with its arguments. A
+// read-only call is invariant like a load, if nothing in the loop modifies
+// the memory it may read.
+bool LoopInvariantHoistPass::isCallInvariant(const CallBase &call) const {
+  if (aliasAnalysis->getMemoryEffects(&call).doesNotAccessMemory())
+    return true;
+
+  if (memorySSA) {
+    MemoryAccess *clobber =
+        memorySSA->getWalker()->getClobberingMemoryAccess(&call);
+    return memorySSA->isLiveOnEntryDef(clobber) ||
+           !currentLoop->contains(clobber->getBlock());
+  }
+
+  return llvm::none_of(state.getMemoryWriters(), [&](Instruction *writer) {
+    return isModSet(aliasAnalysis->getModRefInfo(writer, &call));
+  });
 }
 
 void LoopInvariantHoistPass::determineHoistableInstructions() {
@@ -79,79 +309,981 @@ void LoopInvariantHoistPass::determineHoistableInstructions() {
     return true;
   };
 
-  for (auto *I : invariantInstructionsOrder) {
+  // An instruction moved to the preheader runs even when the loop would not
+  // have reached it: unless it is guaranteed to execute, it must not trap.
+  // The others may still be hoisted under the loop guard, together with the
+  // instructions using them that do not read memory: hoistUnderGuard gives
+  // the guarded block no MemorySSA accesses.
+  for (unsigned number : state.getInvariantOrder()) {
+    Instruction *I = state.getInstruction(number);
+    bool hasGuardedOperand = llvm::any_of(I->operands(), [&](const Use &U) {
+      auto operandNumber = state.getNumber(dyn_cast<Instruction>(U));
+      return operandNumber && state.isGuarded(*operandNumber);
+    });
+    if (hasGuardedOperand && I->mayReadFromMemory()) {
+      state.markNonHoistable(number, "Instruction reads memory and depends on "
+                                     "an instruction hoisted under the loop "
+                                     "guard");
+      continue;
+    }
+    bool isSafe = isSafeToSpeculate(*I) ||
+                  safetyInfo.isGuaranteedToExecute(*I, dominatorTree,
+                                                   currentLoop);
+    bool isUnderGuard = hasGuardedOperand || !isSafe;
+    if (!isSafe && !canHoistUnderGuard(*I)) {
+      const char *reason =
+          "Instruction may trap if executed before the loop";
+      if (isa<LoadInst>(I))
+        reason = "Load may not be safe to execute before the loop";
+      else if (isa<CallBase>(I))
+        reason = "Call may not be safe to execute before the loop";
+      state.markNonHoistable(number, reason);
+      continue;
+    }
+
     if (isHoistableInstruction(I)) {
-      hoistableInstructions.insert(I);
-      if (isUnusedOutsideLoop(I)) {
-        hoistReasons[I] = "Instruction is dead after loop";
+      if (isUnderGuard) {
+        state.markHoistable(number, "Instruction runs whenever the loop is "
+                                    "entered: hoisted under the loop guard");
+        state.markGuarded(number);
+      } else if (isUnusedOutsideLoop(I)) {
+        state.markHoistable(number, "Instruction is dead after loop");
       } else {
-        hoistReasons[I] = "Instruction dominates all exits";
+        state.markHoistable(number, "Instruction dominates all exits");
       }
     } else {
-      nonHoistableInstructions.insert(I);
       if (!isUnusedOutsideLoop(I)) {
-        nonHoistReasons[I] = "Instruction is used outside loop";
+        state.markNonHoistable(number, "Instruction is used outside loop");
       } else {
-        nonHoistReasons[I] = "Instruction does not dominate all exits";
+        state.markNonHoistable(number,
+                               "Instruction does not dominate all exits");
       }
     }
   }
 }
 
+// Divisions are speculated also when the divisor is proved non-zero (and, for
+// signed divisions, different from -1) where the preheader ends.
+bool LoopInvariantHoistPass::isSafeToSpeculate(const Instruction &I) const {
+  if (isSafeToSpeculativelyExecute(&I))
+    return true;
+
+  BasicBlock *preheader = currentLoop->getLoopPreheader();
+  if (!preheader)
+    return false;
+  const DataLayout &DL = I.getModule()->getDataLayout();
+  const Instruction *context = preheader->getTerminator();
+  switch (I.getOpcode()) {
+  case Instruction::UDiv:
+  case Instruction::URem:
+    return isKnownNonZero(I.getOperand(1), DL, 0, assumptions, context,
+                          dominatorTree);
+  case Instruction::SDiv:
+  case Instruction::SRem:
+    return isKnownPositive(I.getOperand(1), DL, 0, assumptions, context,
+                           dominatorTree);
+  default:
+    return false;
+  }
+}
+
+// An instruction runs whenever the loop is entered if the header is the only
+// exiting block and its block is on every path from the header to the latch,
+// with nothing in the loop that may throw. Memory is left alone, so that the
+// guarded block needs no MemorySSA accesses.
+bool LoopInvariantHoistPass::canHoistUnderGuard(const Instruction &I) const {
+  if (!GuardedHoisting || I.mayReadFromMemory() ||
+      safetyInfo.anyBlockMayThrow())
+    return false;
+  BasicBlock *latch = currentLoop->getLoopLatch();
+  return latch && dominatorTree->dominates(I.getParent(), latch) &&
+         getLoopGuard(nullptr);
+}
+
+// The header's exit test as evaluated on loop entry, true when the first
+// iteration goes on into the loop body. Without insertBefore only checks it
+// can be computed in the preheader.
+Value *LoopInvariantHoistPass::getLoopGuard(Instruction *insertBefore) const {
+  BasicBlock *header = currentLoop->getHeader();
+  auto *branch = dyn_cast<BranchInst>(header->getTerminator());
+  if (!branch || !branch->isConditional() ||
+      currentLoop->getExitingBlock() != header ||
+      !currentLoop->getLoopPreheader())
+    return nullptr;
+
+  DenseMap<Value *, Value *> entryValues;
+  Value *condition =
+      getValueOnLoopEntry(branch->getCondition(), insertBefore, entryValues);
+  if (!condition || !insertBefore)
+    return condition;
+  if (!currentLoop->contains(branch->getSuccessor(0)))
+    condition =
+        BinaryOperator::CreateNot(condition, "loop.guard", insertBefore);
+  return condition;
+}
+
+// Value computed in the header on the first iteration: header phis take the
+// value coming from the preheader and the instructions are cloned before
+// insertBefore. Only side-effect free, non-memory instructions are cloned;
+// without insertBefore nothing is created.
+Value *LoopInvariantHoistPass::getValueOnLoopEntry(
+    Value *V, Instruction *insertBefore,
+    DenseMap<Value *, Value *> &entryValues) const {
+  auto *I = dyn_cast<Instruction>(V);
+  if (!I || !currentLoop->contains(I))
+    return V;
+  if (I->getParent() != currentLoop->getHeader())
+    return nullptr;
+  if (auto *phi = dyn_cast<PHINode>(I))
+    return phi->getIncomingValueForBlock(currentLoop->getLoopPreheader());
+  if (I->mayReadFromMemory() || !isSafeToSpeculativelyExecute(I))
+    return nullptr;
+
+  if (auto it = entryValues.find(I); it != entryValues.end())
+    return it->second;
+  SmallVector<Value *, 4> operands;
+  for (Value *operand : I->operands()) {
+    Value *entryValue = getValueOnLoopEntry(operand, insertBefore, entryValues);
+    if (!entryValue)
+      return nullptr;
+    operands.push_back(entryValue);
+  }
+  if (!insertBefore)
+    return entryValues[I] = I;
+
+  Instruction *clone = I->clone();
+  for (unsigned index = 0; index < operands.size(); ++index)
+    clone->setOperand(index, operands[index]);
+  clone->setName(I->getName() + ".entry");
+  clone->insertBefore(insertBefore);
+  return entryValues[I] = clone;
+}
+
+// The preheader ends with the loop guard, branching to a block holding the
+// guarded instructions; the loop is then entered from a new preheader, where
+// phis give the hoisted values (poison when the loop is skipped, as the
+// values are then never used). Neither new block accesses memory, so
+// MemorySSA only has to see the header entered from the new preheader.
+BasicBlock *LoopInvariantHoistPass::hoistUnderGuard(BasicBlock *preheader) {
+  Instruction *entryBranch = preheader->getTerminator();
+  Value *guard = getLoopGuard(entryBranch);
+  DomTreeUpdater DTU(dominatorTree, DomTreeUpdater::UpdateStrategy::Eager);
+  Instruction *guardedEnd = SplitBlockAndInsertIfThen(
+      guard, entryBranch, /*Unreachable=*/false, nullptr, &DTU, loopInfo);
+  BasicBlock *guardedBlock = guardedEnd->getParent();
+  BasicBlock *newPreheader = entryBranch->getParent();
+  if (memorySSAUpdater)
+    memorySSAUpdater->moveAllAfterSpliceBlocks(preheader, newPreheader,
+                                               entryBranch);
+  guardedBlock->setName(preheader->getName() + ".guarded");
+  newPreheader->setName(preheader->getName() + ".entry");
+
+  SmallVector<Instruction *, 8> moved;
+  for (unsigned number : state.getInvariantOrder()) {
+    if (!state.isHoistable(number) || !state.isGuarded(number))
+      continue;
+    Instruction *I = state.getInstruction(number);
+    emitMovedRemark("HoistedUnderGuard", "hoisting", *I,
+                    state.getReason(number));
+    I->moveBefore(guardedEnd);
+    moved.push_back(I);
+    ++NumHoisted;
+    ++NumGuarded;
+  }
+
+  for (auto *I : moved) {
+    if (llvm::all_of(I->users(), [&](User *U) {
+          return cast<Instruction>(U)->getParent() == guardedBlock;
+        }))
+      continue;
+    auto *phi = PHINode::Create(I->getType(), 2, I->getName() + ".guarded",
+                                &newPreheader->front());
+    phi->addIncoming(I, guardedBlock);
+    phi->addIncoming(PoisonValue::get(I->getType()), preheader);
+    I->replaceUsesWithIf(phi, [&](Use &U) {
+      auto *userInst = cast<Instruction>(U.getUser());
+      return userInst != phi && userInst->getParent() != guardedBlock;
+    });
+  }
+  return newPreheader;
+}
+
+// Blocks are visited in post-order, so the users of an instruction in the
+// loop are classified before it.
+void LoopInvariantHoistPass::determineSinkableInstructions() {
+  LoopBlocksRPO RPO(currentLoop);
+  RPO.perform(loopInfo);
+  for (auto *BB : llvm::reverse(RPO)) {
+    for (auto &I : llvm::reverse(*BB)) {
+      unsigned number = *state.getNumber(&I);
+      if (!state.isHoistable(number) && canSink(I))
+        state.markSinkable(number, "Instruction is only used after the loop");
+    }
+  }
+}
+
+// The value of an instruction leaving the loop is the one computed on the
+// last iteration, so it can be computed in an exit block instead if its block
+// dominates the exiting block, and the values it needs are available there.
+// Every use must be an LCSSA phi of an exit with a single predecessor, or an
+// instruction that is sunk too. Memory may change between the two points, so
+// instructions reading it stay in the loop.
+bool LoopInvariantHoistPass::canSink(const Instruction &I) const {
+  if (isa<PHINode>(I) || isa<AllocaInst>(I) || I.isTerminator() ||
+      I.isEHPad() || I.mayHaveSideEffects() || I.mayReadFromMemory() ||
+      I.use_empty())
+    return false;
+
+  return llvm::all_of(I.users(), [&](const User *U) {
+    auto *userInst = cast<Instruction>(U);
+    if (auto userNumber = state.getNumber(userInst))
+      return state.isSinkable(*userNumber);
+    auto *phi = dyn_cast<PHINode>(userInst);
+    if (!phi)
+      return false;
+    const BasicBlock *exiting = phi->getParent()->getSinglePredecessor();
+    return exiting && currentLoop->contains(exiting) &&
+           dominatorTree->dominates(I.getParent(), exiting);
+  });
+}
+
+// Users are sunk before their operands: each of them leaves an LCSSA phi for
+// the operands it needs, which are then replaced in turn.
+bool LoopInvariantHoistPass::sinkToExitBlocks() {
+  LoopBlocksRPO RPO(currentLoop);
+  RPO.perform(loopInfo);
+  bool sunk = false;
+  for (auto *BB : llvm::reverse(RPO)) {
+    for (auto &I : llvm::make_early_inc_range(llvm::reverse(*BB))) {
+      auto number = state.getNumber(&I);
+      if (number && state.isSinkable(*number) && sinkInstruction(I))
+        sunk = true;
+    }
+  }
+  return sunk;
+}
+
+// Replaces every LCSSA phi of the instruction with a copy computed at the
+// beginning of the phi's exit block.
+bool LoopInvariantHoistPass::sinkInstruction(Instruction &I) {
+  SmallVector<PHINode *, 4> exitPhis;
+  for (auto *U : I.users()) {
+    auto *phi = dyn_cast<PHINode>(U);
+    if (!phi || currentLoop->contains(phi) ||
+        !phi->getParent()->getSinglePredecessor())
+      return false;
+    exitPhis.push_back(phi);
+  }
+
+  emitMovedRemark("Sunk", "sinking", I,
+                  state.getReason(*state.getNumber(&I)));
+  SmallVector<Instruction *, 4> copies;
+  for (auto *phi : exitPhis) {
+    BasicBlock *exitBlock = phi->getParent();
+    Instruction *copy = I.clone();
+    copies.push_back(copy);
+    copy->insertBefore(&*exitBlock->getFirstInsertionPt());
+    for (Use &operand : copy->operands())
+      if (auto *operandInst = dyn_cast<Instruction>(operand))
+        if (currentLoop->contains(operandInst))
+          operand.set(getExitValue(operandInst, exitBlock));
+    phi->replaceAllUsesWith(copy);
+    phi->eraseFromParent();
+  }
+  copies.front()->takeName(&I);
+  for (auto *copy : llvm::drop_begin(copies))
+    copy->setName(copies.front()->getName());
+  I.eraseFromParent();
+  ++NumSunk;
+  return true;
+}
+
+// LCSSA phi carrying a value of the loop into an exit block with a single
+// predecessor, created if missing.
+Value *LoopInvariantHoistPass::getExitValue(Instruction *V,
+                                            BasicBlock *exitBlock) const {
+  BasicBlock *exiting = exitBlock->getSinglePredecessor();
+  for (auto &phi : exitBlock->phis())
+    if (phi.getIncomingValueForBlock(exiting) == V)
+      return &phi;
+
+  auto *phi = PHINode::Create(V->getType(), 1, V->getName() + ".lcssa",
+                              &exitBlock->front());
+  phi->addIncoming(V, exiting);
+  return phi;
+}
+
 bool LoopInvariantHoistPass::isLoopExiting(const BasicBlock *BB) {
   return llvm::any_of(successors(BB), [this](const BasicBlock *Succ) {
     return !currentLoop->contains(Succ);
   });
 }
 
-void LoopInvariantHoistPass::printAnalysisResult() {
-  outs() << "--- ANALYSIS RESULT: ---\n";
+unsigned LoopInvariantHoistPass::getRegisterClass(const Value *V) const {
+  Type *Ty = V->getType();
+  return targetInfo->getRegisterClassForType(Ty->isVectorTy(), Ty);
+}
+
+unsigned LoopInvariantHoistPass::getRegisterBudget(unsigned RC) const {
+  if (RegisterBudgetOverride)
+    return RegisterBudgetOverride;
+  return targetInfo->getNumberOfRegisters(RC);
+}
+
+// Maximum number of simultaneously live values of each register class, over
+// every program point of the loop and the end of the preheader. Each block is
+// scanned backward from the values live at its terminator.
+SmallDenseMap<unsigned, unsigned, 4>
+LoopInvariantHoistPass::estimateRegisterPressure(
+    const Liveness &liveness) const {
+  const ValueDomain &domain = liveness.getDomain();
+  SmallDenseMap<unsigned, unsigned, 4> maxPressure;
+
+  auto scan = [&](const BasicBlock *BB, bool wholeBlock) {
+    BitVector live = liveness.getLiveOut(*BB);
+    SmallDenseMap<unsigned, unsigned, 4> pressure;
+    for (unsigned id : live.set_bits())
+      if (const Value *V = domain.getValue(id))
+        ++pressure[getRegisterClass(V)];
+    for (auto &[RC, count] : pressure)
+      maxPressure[RC] = std::max(maxPressure[RC], count);
+    if (!wholeBlock)
+      return;
+
+    for (const Instruction &I : llvm::reverse(*BB)) {
+      if (auto id = domain.lookup(&I); id && live.test(*id)) {
+        live.reset(*id);
+        --pressure[getRegisterClass(&I)];
+      }
+      if (isa<PHINode>(I))
+        continue;
+      for (const Value *operand : I.operands()) {
+        auto id = domain.lookup(operand);
+        if (!id || live.test(*id))
+          continue;
+        live.set(*id);
+        unsigned RC = getRegisterClass(operand);
+        maxPressure[RC] = std::max(maxPressure[RC], ++pressure[RC]);
+      }
+    }
+  };
+
+  for (auto *BB : currentLoop->getBlocks())
+    scan(BB, true);
+  if (auto *preheader = currentLoop->getLoopPreheader())
+    scan(preheader, false);
+  return maxPressure;
+}
+
+// A simple load of an invariant address that is not invariant: something in
+// the loop may write the location it reads.
+bool LoopInvariantHoistPass::hasLoadBlockedByAliasing() const {
+  for (auto *BB : currentLoop->getBlocks()) {
+    for (auto &I : *BB) {
+      auto *load = dyn_cast<LoadInst>(&I);
+      if (load && load->isSimple() &&
+          currentLoop->isLoopInvariant(load->getPointerOperand()) &&
+          !state.isInvariant(*state.getNumber(load)))
+        return true;
+    }
+  }
+  return false;
+}
+
+// Loop multiversioning. When loads of invariant addresses stay in the loop
+// because other pointers may alias them, and LoopAccessInfo can bound every
+// pointer of the loop, the loop is cloned: runtime checks of the pointer
+// ranges in the preheader choose between this loop, whose accesses are
+// annotated as not aliasing and can then be hoisted and promoted, and the
+// unchanged clone as fallback. Only the groups of pointers checked against
+// each other are annotated, so accesses through the same pointer (as the
+// load and store of a reduction) keep their dependence. MemorySSA is not kept
+// up to date across the cloning, so loops are versioned only when the pass
+// runs without it. Both loops are marked, so they are never versioned again,
+// and the fallback is handed to the loop pass manager as a sibling.
+bool LoopInvariantHoistPass::versionForNoAlias(
+    const TargetLibraryInfo &libraryInfo, LPMUpdater &U) {
+  if (!LoopVersioningEnabled || memorySSA || !currentLoop->isInnermost() ||
+      getBooleanLoopAttribute(currentLoop,
+                              "llvm.loop.licm_versioning.disable") ||
+      !hasLoadBlockedByAliasing())
+    return false;
+
+  LoopAccessInfoManager accessInfos(*scalarEvolution, *aliasAnalysis,
+                                    *dominatorTree, *loopInfo, &libraryInfo);
+  const LoopAccessInfo &accessInfo = accessInfos.getInfo(*currentLoop);
+  const RuntimePointerChecking *pointerChecks =
+      accessInfo.getRuntimePointerChecking();
+  if (accessInfo.hasConvergentOp() || !pointerChecks->Need ||
+      pointerChecks->getNumberOfChecks() >
+          VectorizerParams::RuntimeMemoryCheckThreshold)
+    return false;
+
+  LoopVersioning versioning(accessInfo, pointerChecks->getChecks(),
+                            currentLoop, loopInfo, dominatorTree,
+                            scalarEvolution);
+  versioning.versionLoop();
+  versioning.annotateLoopWithNoAlias();
+  addStringMetadataToLoop(currentLoop, "llvm.loop.licm_versioning.disable", 1);
+  addStringMetadataToLoop(versioning.getNonVersionedLoop(),
+                          "llvm.loop.licm_versioning.disable", 1);
+  U.addSiblingLoops({versioning.getNonVersionedLoop()});
+  ++NumVersioned;
+
+  remarks->emit([&] {
+    return OptimizationRemark(DEBUG_TYPE, "Versioned",
+                              currentLoop->getStartLoc(),
+                              currentLoop->getHeader())
+           << "loop versioned under "
+           << ore::NV("Checks", pointerChecks->getNumberOfChecks())
+           << " runtime alias checks";
+  });
+  return true;
+}
+
+// In the preheader an instruction runs once per loop entry. It is worth
+// moving only if its block runs more often than that: an instruction in a
+// rarely taken branch would otherwise be paid for on every entry. Only the
+// frequencies of functions with profile data (the branch weights of a
+// .profdata file) are trusted: the loop pass manager provides
+// BlockFrequencyInfo to custom-licm in any case, and without a profile it is
+// a static guess. Every hoistable instruction is then kept hoistable.
+void LoopInvariantHoistPass::applyBlockFrequencies() {
+  if (!blockFrequencies || !state.hasHoistable() ||
+      !currentLoop->getHeader()->getParent()->hasProfileData())
+    return;
+
+  BlockFrequency preheaderFrequency =
+      blockFrequencies->getBlockFreq(currentLoop->getLoopPreheader());
+  for (unsigned number : state.getInvariantOrder()) {
+    if (!state.isHoistable(number))
+      continue;
+    const BasicBlock *BB = state.getInstruction(number)->getParent();
+    if (blockFrequencies->getBlockFreq(BB) <= preheaderFrequency)
+      state.markNonHoistable(number,
+                             "Block runs less often than the preheader");
+  }
+}
+
+// Every hoisted instruction ran as often as its block and will run as often
+// as the preheader: the difference, if positive, is the dynamic instructions
+// saved (a block of the loop may run less often than the preheader). The
+// estimate is reported per loop entry, from the static frequencies when there
+// is no profile, and, when the function has profile counts, as the number of
+// instructions saved in the profiled run.
+void LoopInvariantHoistPass::reportHoistingSavings(BasicBlock *preheader) {
+  if (!blockFrequencies || !state.hasHoistable())
+    return;
+  uint64_t preheaderFrequency =
+      blockFrequencies->getBlockFreq(preheader).getFrequency();
+  if (preheaderFrequency == 0)
+    return;
+
+  auto preheaderCount = blockFrequencies->getBlockProfileCount(preheader);
+  uint64_t savedFrequency = 0;
+  uint64_t savedCount = 0;
+  for (unsigned number : state.getInvariantOrder()) {
+    if (!state.isHoistable(number))
+      continue;
+    const BasicBlock *BB = state.getInstruction(number)->getParent();
+    uint64_t frequency = blockFrequencies->getBlockFreq(BB).getFrequency();
+    savedFrequency +=
+        frequency > preheaderFrequency ? frequency - preheaderFrequency : 0;
+    if (!preheaderCount)
+      continue;
+    if (auto count = blockFrequencies->getBlockProfileCount(BB))
+      savedCount += *count > *preheaderCount ? *count - *preheaderCount : 0;
+  }
+  NumDynamicInstructionsSaved += savedCount;
+
+  remarks->emit([&] {
+    float perEntry = static_cast<float>(savedFrequency) / preheaderFrequency;
+    OptimizationRemarkAnalysis remark(DEBUG_TYPE, "HoistingSavings",
+                                      currentLoop->getStartLoc(),
+                                      currentLoop->getHeader());
+    remark << "hoisting saves an estimated "
+           << ore::NV("SavedPerEntry", formatv("{0:f2}", perEntry).str())
+           << " dynamic instructions per loop entry";
+    if (preheaderCount)
+      remark << " (" << ore::NV("SavedInProfile", savedCount)
+             << " in the profiled run)";
+    return remark;
+  });
+}
+
+// Liveness is a whole-function problem, so its solution is shared by the
+// loops of the function instead of being solved for each of them. It is
+// solved again once this pass has changed the function, or once another pass
+// of the pipeline has: that pass erased a block or a value of the solution,
+// which the watches catch before it can be read, or it added some, which
+// changes the number of blocks or instructions.
+const Liveness &
+LoopInvariantHoistPass::getFunctionLiveness(Function &function) {
+  size_t instructions = function.getInstructionCount();
+  if (livenessFunction == &function && !livenessErased &&
+      livenessBlocks == function.size() &&
+      livenessInstructions == instructions)
+    return functionLiveness;
+
+  functionLiveness.solve(function);
+  livenessFunction = &function;
+  livenessBlocks = function.size();
+  livenessInstructions = instructions;
+  livenessErased = false;
+
+  const ValueDomain &domain = functionLiveness.getDomain();
+  livenessWatches.clear();
+  livenessWatches.reserve(livenessBlocks + domain.size());
+  for (auto &BB : function)
+    livenessWatches.emplace_back(&BB, &livenessErased);
+  for (unsigned id = 0; id < domain.size(); ++id)
+    livenessWatches.emplace_back(const_cast<Value *>(domain.getValue(id)),
+                                 &livenessErased);
+  return functionLiveness;
+}
+
+// Hoisting I keeps its value in a register across the whole loop, unless
+// every user is hoisted too. An operand defined outside the loop stops being
+// live across it once all of its users in the loop are hoisted and nothing
+// after the loop reads it. Candidates are accepted in discovery order while
+// the estimated pressure fits the target's registers; a rejected instruction
+// also keeps in the loop every candidate depending on it.
+void LoopInvariantHoistPass::applyRegisterBudget() {
+  if (!state.hasHoistable())
+    return;
+
+  const Liveness &liveness =
+      getFunctionLiveness(*currentLoop->getHeader()->getParent());
+  const ValueDomain &domain = liveness.getDomain();
+  SmallDenseMap<unsigned, unsigned, 4> pressure =
+      estimateRegisterPressure(liveness);
+
+  SmallVector<BasicBlock *, 4> exitBlocks;
+  currentLoop->getExitBlocks(exitBlocks);
+  auto isLiveAfterLoop = [&](const Value *V) {
+    auto id = domain.lookup(V);
+    return id && llvm::any_of(exitBlocks, [&](const BasicBlock *exit) {
+             return liveness.getIn(*exit).test(*id);
+           });
+  };
+
+  // Candidates not yet visited are still marked hoistable, so a user stays
+  // in the loop exactly when it is not hoistable (anymore).
+  SmallPtrSet<const Value *, 8> freedOperands;
+  auto staysInLoop = [&](User *U) {
+    auto number = state.getNumber(dyn_cast<Instruction>(U));
+    return number && !state.isHoistable(*number);
+  };
+
+  for (unsigned number : state.getInvariantOrder()) {
+    if (!state.isHoistable(number))
+      continue;
+    Instruction *I = state.getInstruction(number);
+
+    if (llvm::any_of(I->operands(), [&](const Use &U) {
+          auto operandNumber = state.getNumber(dyn_cast<Instruction>(U));
+          return operandNumber && state.isInvariant(*operandNumber) &&
+                 !state.isHoistable(*operandNumber);
+        })) {
+      state.markNonHoistable(
+          number, "Instruction depends on an instruction kept in the loop");
+      continue;
+    }
+
+    SmallDenseMap<unsigned, int, 4> delta;
+    if (ValueDomain::isCandidate(*I) && llvm::any_of(I->users(), staysInLoop))
+      ++delta[getRegisterClass(I)];
+
+    SmallVector<const Value *, 2> freed;
+    for (Value *operand : I->operands()) {
+      if (!ValueDomain::isCandidate(*operand) || freedOperands.count(operand))
+        continue;
+      auto *operandInst = dyn_cast<Instruction>(operand);
+      if (operandInst && currentLoop->contains(operandInst))
+        continue;
+      if (llvm::any_of(operand->users(), staysInLoop) ||
+          isLiveAfterLoop(operand))
+        continue;
+      --delta[getRegisterClass(operand)];
+      freed.push_back(operand);
+    }
+
+    bool fits = llvm::all_of(delta, [&](const auto &entry) {
+      auto [RC, change] = entry;
+      return change <= 0 || pressure[RC] + change <= getRegisterBudget(RC);
+    });
+    if (!fits) {
+      state.markNonHoistable(number,
+                             "Hoisting would exceed the register budget");
+      continue;
+    }
+
+    for (auto [RC, change] : delta)
+      pressure[RC] = std::max(0, static_cast<int>(pressure[RC]) + change);
+    freedOperands.insert(freed.begin(), freed.end());
+  }
+}
+
+// Remarks are built only when they are enabled (-pass-remarks*, or a remark
+// file given with -pass-remarks-output), so the analysis costs nothing extra
+// otherwise. Invariant instructions are reported as analysis remarks, the
+// ones left in the loop as missed remarks with the reason.
+void LoopInvariantHoistPass::emitAnalysisRemarks() const {
+  for (unsigned number : state.getInvariantOrder()) {
+    const Instruction *I = state.getInstruction(number);
+    remarks->emit([&] {
+      return OptimizationRemarkAnalysis(DEBUG_TYPE, "LoopInvariant", I)
+             << ore::NV("Inst", I) << " is loop invariant";
+    });
+    if (state.isNonHoistable(number))
+      remarks->emit([&] {
+        return OptimizationRemarkMissed(DEBUG_TYPE, "NotHoisted", I)
+               << "failed to hoist " << ore::NV("Inst", I) << ": "
+               << ore::NV("Reason", state.getReason(number));
+      });
+  }
+}
+
+void LoopInvariantHoistPass::emitMovedRemark(StringRef remarkName,
+                                             StringRef action,
+                                             const Instruction &I,
+                                             StringRef reason) const {
+  remarks->emit([&] {
+    return OptimizationRemark(DEBUG_TYPE, remarkName, &I)
+           << action << " " << ore::NV("Inst", &I) << ": "
+           << ore::NV("Reason", reason);
+  });
+}
+
+namespace {
+
+// Rewrites the accesses to a promoted location on the value kept in a
+// register, and stores the final value back at every exit of the loop.
+class LoopPromoter : public LoadAndStorePromoter {
+public:
+  LoopPromoter(ArrayRef<const Instruction *> accesses, SSAUpdater &SSA,
+               Value *pointer, Align alignment,
+               ArrayRef<BasicBlock *> exitBlocks, MemorySSAUpdater *MSSAU)
+      : LoadAndStorePromoter(accesses, SSA), SSA(SSA), pointer(pointer),
+        alignment(alignment), exitBlocks(exitBlocks), MSSAU(MSSAU) {}
+
+  void doExtraRewritesBeforeFinalDeletion() override {
+    for (auto *exit : exitBlocks) {
+      Value *value = SSA.GetValueInMiddleOfBlock(exit);
+      auto *store = new StoreInst(value, pointer, /*isVolatile=*/false,
+                                  alignment, &*exit->getFirstInsertionPt());
+      if (MSSAU) {
+        MemoryAccess *access = MSSAU->createMemoryAccessInBB(
+            store, nullptr, exit, MemorySSA::Beginning);
+        MSSAU->insertDef(cast<MemoryDef>(access), /*RenameUses=*/true);
+      }
+    }
+  }
+
+  void instructionDeleted(Instruction *I) const override {
+    if (MSSAU)
+      MSSAU->removeMemoryAccess(I);
+  }
+
+private:
+  SSAUpdater &SSA;
+  Value *pointer;
+  Align alignment;
+  ArrayRef<BasicBlock *> exitBlocks;
+  MemorySSAUpdater *MSSAU;
+};
+
+} // namespace
+
+// Scalar promotion: the loads and stores of a loop invariant address become
+// uses and definitions of an SSA value, loaded once in the preheader and
+// stored once at each exit. Accesses are grouped by pointer, so only
+// locations accessed through the same value are promoted.
+bool LoopInvariantHoistPass::promoteMemoryToRegisters(BasicBlock *preheader) {
+  if (!currentLoop->hasDedicatedExits())
+    return false;
+
+  SmallMapVector<Value *, SmallVector<Instruction *, 4>, 4> candidates;
+  for (auto *BB : currentLoop->getBlocks()) {
+    for (auto &I : *BB) {
+      Value *pointer = getLoadStorePointerOperand(&I);
+      if (pointer && currentLoop->isLoopInvariant(pointer))
+        candidates[pointer].push_back(&I);
+    }
+  }
+
+  // Hoisting moved instructions out of the loop.
+  safetyInfo.computeLoopSafetyInfo(currentLoop);
+
+  bool promoted = false;
+  for (auto &[pointer, accesses] : candidates) {
+    if (!canPromote(pointer, accesses))
+      continue;
+    remarks->emit([&] {
+      return OptimizationRemark(DEBUG_TYPE, "PromoteLoopAccessesToScalar",
+                                accesses.front())
+             << "moving accesses to memory location out of the loop";
+    });
+    promote(pointer, accesses, preheader);
+    ++NumPromoted;
+    promoted = true;
+  }
+
+  if (promoted)
+    formLCSSA(*currentLoop, *dominatorTree, loopInfo, scalarEvolution);
+  return promoted;
+}
+
+// A location can live in a register if the loop accesses it only through
+// simple loads and stores of the same type, nothing else in the loop may
+// read or write it, and one of the stores runs whenever the loop does: this
+// makes both the load in the preheader and the stores at the exits safe.
+bool LoopInvariantHoistPass::canPromote(Value *pointer,
+                                        ArrayRef<Instruction *> accesses) {
+  Type *type = getLoadStoreType(accesses.front());
+  bool hasGuaranteedStore = false;
+  for (auto *I : accesses) {
+    if (getLoadStoreType(I) != type)
+      return false;
+    if (auto *load = dyn_cast<LoadInst>(I)) {
+      if (!load->isSimple())
+        return false;
+      continue;
+    }
+    auto *store = cast<StoreInst>(I);
+    if (!store->isSimple() || store->getValueOperand() == pointer)
+      return false;
+    hasGuaranteedStore = hasGuaranteedStore ||
+                         safetyInfo.isGuaranteedToExecute(
+                             *store, dominatorTree, currentLoop);
+  }
+  if (!hasGuaranteedStore)
+    return false;
 
-  outs() << "Loop invariant instructions:\n";
-  for (auto *I : loopInvariantInstructions) {
-    outs() << *I << '\n';
+  for (auto *U : pointer->users()) {
+    auto *userInst = dyn_cast<Instruction>(U);
+    if (userInst && currentLoop->contains(userInst) &&
+        !llvm::is_contained(accesses, userInst))
+      return false;
   }
 
-  outs() << "Hoistable instructions:\n";
-  for (auto *I : hoistableInstructions) {
-    outs() << *I << " | Reason: " << hoistReasons[I] << '\n';
+  // The alias metadata common to every access, such as the scopes added by
+  // loop versioning, still describes the location.
+  MemoryLocation location = MemoryLocation::get(accesses.front());
+  for (auto *I : accesses.drop_front())
+    location.AATags = location.AATags.merge(I->getAAMetadata());
+  for (auto *BB : currentLoop->getBlocks()) {
+    for (auto &I : *BB) {
+      if (!I.mayReadOrWriteMemory() || llvm::is_contained(accesses, &I))
+        continue;
+      if (isModOrRefSet(aliasAnalysis->getModRefInfo(&I, location)))
+        return false;
+    }
   }
+  return true;
+}
+
+void LoopInvariantHoistPass::promote(Value *pointer,
+                                     ArrayRef<Instruction *> accesses,
+                                     BasicBlock *preheader) {
+  Type *type = getLoadStoreType(accesses.front());
+  Align alignment = getLoadStoreAlignment(accesses.front());
+  for (auto *I : accesses)
+    alignment = std::min(alignment, getLoadStoreAlignment(I));
 
-  outs() << "Non-hoistable instructions:\n";
-  for (auto *I : nonHoistableInstructions) {
-    outs() << *I << " | Reason: " << nonHoistReasons[I] << '\n';
+  SmallVector<BasicBlock *, 4> exitBlocks;
+  currentLoop->getUniqueExitBlocks(exitBlocks);
+
+  SmallVector<const Instruction *, 8> constAccesses(accesses.begin(),
+                                                    accesses.end());
+  SSAUpdater SSA;
+  LoopPromoter promoter(constAccesses, SSA, pointer, alignment, exitBlocks,
+                        memorySSAUpdater);
+
+  auto *initial =
+      new LoadInst(type, pointer, pointer->getName() + ".promoted",
+                   /*isVolatile=*/false, alignment, preheader->getTerminator());
+  if (memorySSAUpdater) {
+    MemoryAccess *access = memorySSAUpdater->createMemoryAccessInBB(
+        initial, nullptr, preheader, MemorySSA::End);
+    memorySSAUpdater->insertUse(cast<MemoryUse>(access),
+                                /*RenameUses=*/true);
   }
+  SSA.AddAvailableValue(preheader, initial);
 
-  outs() << "-------------------------\n";
+  SmallVector<Instruction *, 8> toRewrite(accesses.begin(), accesses.end());
+  promoter.run(toRewrite);
 }
 
 bool LoopInvariantHoistPass::runOnLoop(Loop *L, LoopAnalysisManager &AM,
-                                       LoopStandardAnalysisResults &AR) {
+                                       LoopStandardAnalysisResults &AR,
+                                       LPMUpdater &U) {
   currentLoop = L;
+  loopInfo = &AR.LI;
   dominatorTree = &AR.DT;
+  targetInfo = &AR.TTI;
+  aliasAnalysis = &AR.AA;
+  assumptions = &AR.AC;
+  memorySSA = AR.MSSA;
+  scalarEvolution = &AR.SE;
+  blockFrequencies = AR.BFI;
 
-  analyze(L, AM, AR);
+  std::optional<MemorySSAUpdater> updater;
+  if (memorySSA)
+    updater.emplace(memorySSA);
+  memorySSAUpdater = updater ? &*updater : nullptr;
+  OptimizationRemarkEmitter ORE(L->getHeader()->getParent());
+  remarks = &ORE;
 
   auto *Preheader = L->getLoopPreheader();
   if (!Preheader) {
-    errs() << "The loop is not in canonical form. Skipping.\n";
+    ORE.emit([&] {
+      return OptimizationRemarkMissed(DEBUG_TYPE, "LoopNotInCanonicalForm",
+                                      L->getStartLoc(), L->getHeader())
+             << "loop has no preheader: run loop-simplify first";
+    });
     return false;
   }
 
-  IRBuilder<> Builder(Preheader, Preheader->begin());
+  analyze(L, AM, AR);
+
   bool Changed = false;
+  if (versionForNoAlias(AR.TLI, U)) {
+    Preheader = L->getLoopPreheader();
+    livenessFunction = nullptr;
+    analyze(L, AM, AR);
+    Changed = true;
+  }
+
+  IRBuilder<> Builder(Preheader, Preheader->begin());
+  reportHoistingSavings(Preheader);
 
-  for (auto *I : hoistableInstructions) {
+  // Discovery order puts every instruction after its invariant operands.
+  for (unsigned number : state.getInvariantOrder()) {
+    if (!state.isHoistable(number) || state.isGuarded(number))
+      continue;
+    Instruction *I = state.getInstruction(number);
+    emitMovedRemark("Hoisted", "hoisting", *I, state.getReason(number));
     I->moveBefore(Preheader->getTerminator());
+    if (memorySSAUpdater)
+      if (MemoryUseOrDef *access = memorySSA->getMemoryAccess(I))
+        memorySSAUpdater->moveToPlace(access, Preheader,
+                                      MemorySSA::BeforeTerminator);
+    ++NumHoisted;
     Changed = true;
   }
+  if (state.hasGuarded()) {
+    Preheader = hoistUnderGuard(Preheader);
+    Changed = true;
+  }
+  if (Changed && AreStatisticsEnabled())
+    NumHoistedMissedByBlockOrder += countHoistableMissedByBlockOrder();
+
+  if (promoteMemoryToRegisters(Preheader))
+    Changed = true;
 
+  if (sinkToExitBlocks())
+    Changed = true;
+
+  if (Changed) {
+    scalarEvolution->forgetLoopDispositions();
+    if (memorySSA && VerifyMemorySSA)
+      memorySSA->verifyMemorySSA();
+    livenessFunction = nullptr;
+  }
+  memorySSAUpdater = nullptr;
+  remarks = nullptr;
   return Changed;
 }
 
+// MemorySSA, when the loop pass manager provides it, is kept up to date.
 PreservedAnalyses LoopInvariantHoistPass::run(Loop &L, LoopAnalysisManager &AM,
                                               LoopStandardAnalysisResults &AR,
                                               LPMUpdater &U) {
-  return runOnLoop(&L, AM, AR) ? PreservedAnalyses::none()
-                               : PreservedAnalyses::all();
+  if (!runOnLoop(&L, AM, AR, U))
+    return PreservedAnalyses::all();
+
+  PreservedAnalyses PA = getLoopPassPreservedAnalyses();
+  if (AR.MSSA)
+    PA.preserve<MemorySSAAnalysis>();
+  return PA;
+}
+
+// Instructions the loop nest mode may move: they neither touch memory nor
+// trap, so no alias or speculation analysis is needed for any level.
+static bool isNestHoistCandidate(const Instruction &I) {
+  return !isa<PHINode>(I) && !isa<AllocaInst>(I) && !I.isTerminator() &&
+         !I.isEHPad() && !I.getType()->isVoidTy() && !I.mayHaveSideEffects() &&
+         !I.mayReadFromMemory() && isSafeToSpeculativelyExecute(&I);
+}
+
+// The blocks of the nest are visited in reverse post-order, so the operands
+// of an instruction already have their final place when it is visited. The
+// instruction then belongs to the deepest level holding one of its operands:
+// it is moved to the preheader of the loop just below that level, crossing
+// every loop it is invariant in with a single move.
+PreservedAnalyses
+LoopNestInvariantHoistPass::run(LoopNest &LN, LoopAnalysisManager &AM,
+                                LoopStandardAnalysisResults &AR,
+                                LPMUpdater &U) {
+  Loop &outermost = LN.getOutermostLoop();
+  unsigned outsideDepth = outermost.getLoopDepth() - 1;
+
+  // Loop depth of the place of every instruction visited so far.
+  DenseMap<const Instruction *, unsigned> placement;
+  auto getDepth = [&](const Value *V) {
+    auto *I = dyn_cast<Instruction>(V);
+    if (!I || !outermost.contains(I))
+      return outsideDepth;
+    auto it = placement.find(I);
+    if (it != placement.end())
+      return it->second;
+    return AR.LI.getLoopDepth(I->getParent());
+  };
+
+  OptimizationRemarkEmitter ORE(outermost.getHeader()->getParent());
+  LoopBlocksRPO RPO(&outermost);
+  RPO.perform(&AR.LI);
+  bool changed = false;
+  for (auto *BB : RPO) {
+    Loop *loop = AR.LI.getLoopFor(BB);
+    unsigned depth = loop->getLoopDepth();
+    for (auto &I : llvm::make_early_inc_range(*BB)) {
+      unsigned level = depth;
+      if (isNestHoistCandidate(I)) {
+        level = outsideDepth;
+        for (Value *operand : I.operands())
+          level = std::max(level, getDepth(operand));
+      }
+
+      if (level < depth) {
+        Loop *destination = loop;
+        while (destination->getLoopDepth() > level + 1)
+          destination = destination->getParentLoop();
+        if (BasicBlock *preheader = destination->getLoopPreheader()) {
+          ORE.emit([&] {
+            return OptimizationRemark(DEBUG_TYPE, "Hoisted", &I)
+                   << "hoisting " << ore::NV("Inst", &I) << " out of "
+                   << ore::NV("Loops", depth - level) << " loops";
+          });
+          I.moveBefore(preheader->getTerminator());
+          ++NumHoisted;
+          NumNestLevelsSkipped += depth - level - 1;
+          changed = true;
+        } else {
+          level = depth;
+        }
+      }
+      placement[&I] = level;
+    }
+  }
+
+  if (!changed)
+    return PreservedAnalyses::all();
+
+  AR.SE.forgetLoopDispositions();
+  PreservedAnalyses PA = getLoopPassPreservedAnalyses();
+  if (AR.MSSA)
+    PA.preserve<MemorySSAAnalysis>();
+  return PA;
 }
@@ -1,23 +1,51 @@
 #include "LoopFusion.hpp"
 
+#include <algorithm>
 #include <cstddef>
+#include <limits>
 #include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/Analysis/AssumptionCache.h>
+#include <llvm/Analysis/IVDescriptors.h>
 #include <llvm/Analysis/LoopAnalysisManager.h>
 #include <llvm/Analysis/LoopInfo.h>
+#include <llvm/Analysis/OptimizationRemarkEmitter.h>
+#include <llvm/Analysis/MemoryLocation.h>
 #include <llvm/Analysis/ScalarEvolutionExpressions.h>
+#include <llvm/Analysis/ValueTracking.h>
 #include <llvm/IR/BasicBlock.h>
 #include <llvm/IR/CFG.h>
 #include <llvm/IR/Function.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/IntrinsicInst.h>
 #include <llvm/IR/PassManager.h>
 #include <llvm/Pass.h>
 #include <llvm/Passes/PassBuilder.h>
 #include <llvm/Passes/PassPlugin.h>
 #include <llvm/Support/Casting.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/MathExtras.h>
+#include <llvm/Transforms/Utils/BasicBlockUtils.h>
+#include <llvm/Transforms/Utils/CodeMoverUtils.h>
 #include <llvm/Transforms/Utils/LoopSimplify.h>
+#include <llvm/Transforms/Utils/LoopUtils.h>
+#include <llvm/Transforms/Utils/ScalarEvolutionExpander.h>
+#include <optional>
 #include <vector>
 
 using namespace llvm;
 
+#define DEBUG_TYPE "custom-loopfusion"
+
+// Reports why a pair of adjacent loops is left as it is. Like every remark it
+// is only built when enabled with -pass-remarks-missed or -pass-remarks-output.
+static void emitNotFusedRemark(OptimizationRemarkEmitter& ORE, const Loop* loopi, const char* reason) {
+    ORE.emit([&] {
+        return OptimizationRemarkMissed(DEBUG_TYPE, "NotFused", loopi->getStartLoc(), loopi->getHeader())
+               << "loop not fused with the adjacent loop that follows it: " << ore::NV("Reason", reason);
+    });
+}
+
 PHINode* LoopFusion::getInductionVariable(Loop* L, ScalarEvolution& SE) const {
     PHINode* canonicalIV = L->getCanonicalInductionVariable();
     if (canonicalIV)
@@ -35,11 +63,287 @@ PHINode* LoopFusion::getInductionVariable(Loop* L, ScalarEvolution& SE) const {
     return nullptr;
 }
 
+static bool testsExitInHeader(const Loop* loop) {
+    BasicBlock* header = loop->getHeader();
+    if (loop->getExitingBlock() != header)
+        return false;
+
+    for (Instruction& inst : *header) {
+        if (isa<PHINode>(inst))
+            continue;
+        for (User* user : inst.users()) {
+            if (cast<Instruction>(user)->getParent() != header)
+                return false;
+        }
+    }
+    BranchInst* headerBranch = dyn_cast<BranchInst>(header->getTerminator());
+    return headerBranch && headerBranch->isConditional();
+}
+
+// Loops are fused in a single shape: simplified and in LCSSA form, with the
+// exit test in a header that only computes it, and a latch that only jumps
+// back to it.
+static bool isInFusionForm(const Loop* loop, DominatorTree& DT) {
+    BasicBlock* latch = loop->getLoopLatch();
+    return loop->isLoopSimplifyForm() && loop->isLCSSAForm(DT) && loop->getExitBlock() && testsExitInHeader(loop) &&
+           latch != loop->getHeader() && &latch->front() == latch->getTerminator();
+}
+
+// Moves the exit test of a rotated loop from the latch to the header, where it
+// checks whether an induction variable has reached the value it takes after
+// the last iteration. The trip count comes from SCEV and must be small enough
+// for the variable not to wrap around to that value earlier; the first test
+// must be known to pass, from a guard in front of the loop or outright. The
+// values used after the loop are those of the previous iteration, kept in
+// header phis.
+//
+// The checks come first and leave the loop as it is: they return the induction
+// variable to test and, in end, the value it is tested against. The loop need
+// not be simplified yet, its preheader will be split off the block it is
+// entered from.
+static PHINode* getUnrotationIV(const Loop* loop, ScalarEvolution& SE, const SCEV*& end) {
+    BasicBlock* latch = loop->getLoopLatch();
+    BasicBlock* predecessor = loop->getLoopPredecessor();
+    if (!latch || !predecessor || !loop->getExitBlock() || loop->getExitingBlock() != latch)
+        return nullptr;
+    BranchInst* latchBranch = dyn_cast<BranchInst>(latch->getTerminator());
+    const SCEV* backedgeTakenCount = SE.getBackedgeTakenCount(loop);
+    if (!latchBranch || !latchBranch->isConditional() || isa<SCEVCouldNotCompute>(backedgeTakenCount))
+        return nullptr;
+
+    const SCEV* tripCount = SE.getAddExpr(backedgeTakenCount, SE.getOne(backedgeTakenCount->getType()));
+    unsigned width = SE.getTypeSizeInBits(tripCount->getType());
+    PHINode* indV = nullptr;
+    const SCEVConstant* step = nullptr;
+    for (PHINode& phi : loop->getHeader()->phis()) {
+        const SCEVAddRecExpr* addrc = dyn_cast<SCEVAddRecExpr>(SE.getSCEV(&phi));
+        if (!addrc || addrc->getLoop() != loop || !addrc->isAffine() || phi.getType() != tripCount->getType())
+            continue;
+        const SCEVConstant* constantStep = dyn_cast<SCEVConstant>(addrc->getStepRecurrence(SE));
+        if (!constantStep || constantStep->getAPInt().isZero())
+            continue;
+        unsigned zeros = constantStep->getAPInt().countTrailingZeros();
+        if (!zeros || SE.isKnownPredicate(ICmpInst::ICMP_ULT, tripCount, SE.getConstant(APInt::getOneBitSet(width, width - zeros)))) {
+            indV = &phi;
+            step = constantStep;
+            break;
+        }
+    }
+    if (!indV)
+        return nullptr;
+
+    end = SE.getAddExpr(SE.getSCEV(indV->getIncomingValueForBlock(predecessor)), SE.getMulExpr(tripCount, step));
+    const SCEV* zero = SE.getZero(tripCount->getType());
+    SCEVExpander expander(SE, loop->getHeader()->getModule()->getDataLayout(), "fusion");
+    if (!expander.isSafeToExpand(end) || (!SE.isKnownPredicate(ICmpInst::ICMP_NE, tripCount, zero) &&
+                                          !SE.isLoopEntryGuardedByCond(loop, ICmpInst::ICMP_NE, tripCount, zero)))
+        return nullptr;
+    return indV;
+}
+
+static bool unrotateLoop(Loop* loop, DominatorTree& DT, LoopInfo& LI, ScalarEvolution& SE) {
+    const SCEV* end;
+    PHINode* indV = getUnrotationIV(loop, SE, end);
+    if (!indV)
+        return false;
+
+    BasicBlock* header = loop->getHeader();
+    BasicBlock* latch = loop->getLoopLatch();
+    BasicBlock* preheader = loop->getLoopPreheader();
+    BasicBlock* exitBlock = loop->getExitBlock();
+    BranchInst* latchBranch = cast<BranchInst>(latch->getTerminator());
+    SCEVExpander expander(SE, header->getModule()->getDataLayout(), "fusion");
+    BasicBlock* body = SplitBlock(header, header->getFirstNonPHI(), &DT, &LI, nullptr, header->getName() + ".body");
+    if (latch == header)
+        latch = body;
+
+    for (PHINode& phi : exitBlock->phis()) {
+        Value* incoming = phi.getIncomingValueForBlock(latch);
+        if (!loop->isLoopInvariant(incoming)) {
+            PHINode* prev = PHINode::Create(incoming->getType(), 2, incoming->getName() + ".prev", header->getFirstNonPHI());
+            prev->addIncoming(PoisonValue::get(incoming->getType()), preheader);
+            prev->addIncoming(incoming, latch);
+            phi.setIncomingValueForBlock(latch, prev);
+        }
+        phi.replaceIncomingBlockWith(latch, header);
+    }
+
+    Value* endValue = expander.expandCodeFor(end, indV->getType(), preheader->getTerminator());
+    ICmpInst* exitCond = new ICmpInst(header->getTerminator(), ICmpInst::ICMP_NE, indV, endValue, "exitcond");
+    BranchInst::Create(body, exitBlock, exitCond, header->getTerminator());
+    header->getTerminator()->eraseFromParent();
+    Instruction* latchCond = dyn_cast<Instruction>(latchBranch->getCondition());
+    BranchInst::Create(header, latchBranch);
+    latchBranch->eraseFromParent();
+    if (latchCond && latchCond->use_empty())
+        latchCond->eraseFromParent();
+
+    DT.recalculate(*header->getParent());
+    SE.forgetLoop(loop);
+    return true;
+}
+
+// A guard in front of loopj that tests the same condition as a guard in front
+// of loopi, and is where the latter skips to, is always taken after loopi.
+// The first guard then skips both loops and the second one is dropped.
+static bool mergeGuards(const Loop* loopi, const Loop* loopj, DominatorTree& DT, ScalarEvolution& SE) {
+    auto isSameCondition = [&](Value* a, Value* b) {
+        ICmpInst* cmpa = dyn_cast<ICmpInst>(a);
+        ICmpInst* cmpb = dyn_cast<ICmpInst>(b);
+        return a == b || (cmpa && cmpb && cmpa->getPredicate() == cmpb->getPredicate() &&
+                          SE.getSCEV(cmpa->getOperand(0)) == SE.getSCEV(cmpb->getOperand(0)) &&
+                          SE.getSCEV(cmpa->getOperand(1)) == SE.getSCEV(cmpb->getOperand(1)));
+    };
+
+    BasicBlock* guard = loopj->getLoopPreheader()->getSinglePredecessor();
+    BranchInst* guardBranch = guard ? dyn_cast<BranchInst>(guard->getTerminator()) : nullptr;
+    if (!guardBranch || !guardBranch->isConditional() || !guard->hasNPredecessorsOrMore(2))
+        return false;
+    unsigned taken = guardBranch->getSuccessor(0) == loopj->getLoopPreheader() ? 0 : 1;
+    BasicBlock* skip = guardBranch->getSuccessor(1 - taken);
+    for (Instruction& inst : *guard) {
+        if (!isa<PHINode>(inst) && &inst != guardBranch && !(&inst == guardBranch->getCondition() && inst.hasOneUse()))
+            return false;
+    }
+
+    for (DomTreeNode* node = DT.getNode(loopi->getLoopPreheader())->getIDom(); node; node = node->getIDom()) {
+        BasicBlock* first = node->getBlock();
+        BranchInst* firstBranch = dyn_cast<BranchInst>(first->getTerminator());
+        if (!firstBranch || !firstBranch->isConditional() || firstBranch->getSuccessor(1 - taken) != guard ||
+            !DT.dominates(firstBranch->getSuccessor(taken), loopi->getLoopPreheader()) ||
+            !isSameCondition(firstBranch->getCondition(), guardBranch->getCondition()))
+            continue;
+
+        // The second guard goes away, so every other way into it must come out of the first loop:
+        // a path skipping the first guard would otherwise run the second loop unconditionally.
+        BasicBlock* entered = firstBranch->getSuccessor(taken);
+        if (!DT.dominates(first, guard) || llvm::any_of(predecessors(guard), [&](BasicBlock* pred) {
+                return pred != first && !DT.dominates(entered, pred);
+            }))
+            return false;
+
+        // What the second guard passes on when skipping, as seen from the first.
+        std::vector<Value*> skipped;
+        for (PHINode& phi : skip->phis()) {
+            Value* incoming = phi.getIncomingValueForBlock(guard);
+            Instruction* inst = dyn_cast<Instruction>(incoming);
+            if (inst && inst->getParent() == guard && isa<PHINode>(inst))
+                incoming = cast<PHINode>(inst)->getIncomingValueForBlock(first);
+            else if (inst && !DT.dominates(inst, firstBranch))
+                return false;
+            skipped.push_back(incoming);
+        }
+
+        size_t k = 0;
+        for (PHINode& phi : skip->phis()) {
+            phi.addIncoming(skipped[k++], first);
+            phi.removeIncomingValue(guard);
+        }
+        for (PHINode& phi : guard->phis())
+            phi.removeIncomingValue(first);
+        firstBranch->setSuccessor(1 - taken, skip);
+
+        Instruction* guardCond = dyn_cast<Instruction>(guardBranch->getCondition());
+        BranchInst::Create(guardBranch->getSuccessor(taken), guardBranch);
+        guardBranch->eraseFromParent();
+        if (guardCond && guardCond->use_empty())
+            guardCond->eraseFromParent();
+        DT.recalculate(*first->getParent());
+        return true;
+    }
+    return false;
+}
+
+// Values of loopi reach loopj only through memory, which the dependence
+// checks cover: once fused, loopj would read them before loopi is done.
+// Before the loops are simplified, the exit of loopi may be the header of
+// loopj.
+static bool usesLiveOuts(const Loop* loopi, const Loop* loopj) {
+    for (BasicBlock* bb : loopj->blocks()) {
+        for (Instruction& inst : *bb) {
+            for (Value* op : inst.operand_values()) {
+                Instruction* opInst = dyn_cast<Instruction>(op);
+                if (opInst && (loopi->contains(opInst) || (opInst->getParent() == loopi->getExitBlock() && !loopj->contains(opInst))))
+                    return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Whether canonicalizeLoops brings the loop into fusion form, judged without
+// changing it: simplification, LCSSA and a latch of its own can always be
+// had, the exit test must already be in the header or be moved there by
+// unrotateLoop.
+static bool canCanonicalize(const Loop* loop, DominatorTree& DT, ScalarEvolution& SE) {
+    if (isInFusionForm(loop, DT))
+        return true;
+    if (loop->isRotatedForm()) {
+        const SCEV* end;
+        return getUnrotationIV(loop, SE, end);
+    }
+    return testsExitInHeader(loop);
+}
+
+// Brings sibling loops, level by level, into the shape they are fused in:
+// whatever the front end and the passes before left, e.g. rotated loops
+// behind a guard after -O1 or -O2, instead of the mem2reg-only form. Only the
+// runs of loops that would be fused once in that shape are changed, so that
+// the others are left as they came; the guards that keep them from being
+// control flow equivalent are merged afterwards.
+bool LoopFusion::canonicalizeLoops(const std::vector<Loop*>& loops, DominatorTree& DT, LoopInfo& LI, ScalarEvolution& SE,
+                                   AssumptionCache& AC, AAResults& AA, const TargetTransformInfo& TTI) const {
+    bool changed = false;
+    for (Loop* loop : loops) {
+        if (loop->getSubLoops().size() > 1)
+            changed |= canonicalizeLoops(loop->getSubLoops(), DT, LI, SE, AC, AA, TTI);
+    }
+
+    std::vector<std::vector<Loop*>> chains;
+    for (size_t i = 1; i < loops.size(); i++) {
+        Loop* loopi = loops[i - 1];
+        Loop* loopj = loops[i];
+        if (!canCanonicalize(loopi, DT, SE) || !canCanonicalize(loopj, DT, SE) || usesLiveOuts(loopi, loopj) ||
+            !haveSameTripCount(SE, loopi, loopj) || !checkNegativeDistanceDeps(SE, AA, loopi, loopj))
+            continue;
+        if (chains.empty() || chains.back().back() != loopi)
+            chains.push_back({loopi});
+        chains.back().push_back(loopj);
+    }
+
+    for (const std::vector<Loop*>& chain : chains) {
+        for (auto [first, last] : partitionChain(chain, SE, AA, LI, TTI)) {
+            for (size_t k = first; k <= last; k++) {
+                Loop* loop = chain[k];
+                changed |= simplifyLoop(loop, &DT, &LI, &SE, &AC, nullptr, false);
+                changed |= formLCSSARecursively(*loop, DT, &LI, &SE);
+                if (loop->isRotatedForm())
+                    changed |= unrotateLoop(loop, DT, LI, SE);
+
+                BasicBlock* latch = loop->getLoopLatch();
+                if (loop->getExitingBlock() == loop->getHeader() && latch != loop->getHeader() &&
+                    &latch->front() != latch->getTerminator()) {
+                    SplitBlock(latch, latch->getTerminator(), &DT, &LI, nullptr, latch->getName() + ".latch");
+                    changed = true;
+                }
+            }
+
+            for (size_t k = first + 1; k <= last; k++) {
+                if (isInFusionForm(chain[k - 1], DT) && isInFusionForm(chain[k], DT) && mergeGuards(chain[k - 1], chain[k], DT, SE)) {
+                    SE.forgetLoop(chain[k]);
+                    changed = true;
+                }
+            }
+        }
+    }
+    return changed;
+}
+
 bool LoopFusion::areLoopsAdjacent(const Loop* i, const Loop* j) const {
     const BasicBlock* iExitBlock = i->getExitBlock();
     const BasicBlock* jPreheader = j->getLoopPreheader();
 
-    return iExitBlock != nullptr && jPreheader != nullptr && iExitBlock == jPreheader && jPreheader->size() == 1;
+    return iExitBlock != nullptr && jPreheader != nullptr && iExitBlock == jPreheader;
 }
 
 void LoopFusion::findAdjacentLoops(const std::vector<Loop*>& loops, std::vector<std::pair<Loop*, Loop*>>& adjLoopPairs) const {
@@ -65,9 +369,17 @@ void LoopFusion::findAdjacentLoops(const std::vector<Loop*>& loops, std::vector<
     }
 }
 
+// Rotated loops are counted as after unrotateLoop, which runs the header
+// once more to leave the loop. Loops whose counts differ are not peeled here:
+// the negative distance checks pair iteration k of both loops, which peeling
+// the front of the first one would shift. Assignment4v2 peels them.
 bool LoopFusion::haveSameTripCount(ScalarEvolution& SE, Loop const* loopi, Loop const* loopj) const {
-    unsigned int tripi = SE.getSmallConstantTripCount(loopi);
-    unsigned int tripj = SE.getSmallConstantTripCount(loopj);
+    auto getTripCount = [&](const Loop* loop) -> unsigned int {
+        unsigned int tripCount = SE.getSmallConstantTripCount(loop);
+        return tripCount && loop->getExitingBlock() == loop->getLoopLatch() ? tripCount + 1 : tripCount;
+    };
+    unsigned int tripi = getTripCount(loopi);
+    unsigned int tripj = getTripCount(loopj);
     return tripi != 0 && tripj != 0 && tripi == tripj;
 }
 
@@ -75,10 +387,335 @@ bool LoopFusion::areControlFlowEquivalent(DominatorTree& DT, PostDominatorTree&
     return DT.dominates(loopi->getHeader(), loopj->getHeader()) && PT.dominates(loopj->getHeader(), loopi->getHeader());
 }
 
-bool LoopFusion::checkNegativeDistanceDeps(Loop* loopi, Loop* loopj) const {
+// Start and step of the address of an access in its loop: an affine add
+// recurrence of the loop, or an address that does not change (step 0).
+static bool getAffineAccess(ScalarEvolution& SE, const SCEV* address, const Loop* loop, const SCEV*& start, const SCEV*& step) {
+    if (SE.isLoopInvariant(address, loop)) {
+        start = address;
+        step = SE.getZero(address->getType());
+        return true;
+    }
+    const auto* addrec = dyn_cast<SCEVAddRecExpr>(address);
+    if (!addrec || addrec->getLoop() != loop || !addrec->isAffine())
+        return false;
+    start = addrec->getStart();
+    step = addrec->getStepRecurrence(SE);
     return true;
 }
 
+static int64_t floorDiv(int64_t a, int64_t b) {
+    int64_t q = a / b;
+    return (a % b != 0 && (a < 0) != (b < 0)) ? q - 1 : q;
+}
+
+// After fusion iteration k of loopi and iteration k of loopj run together.
+// With the same step s the access of loopj at iteration k and the access of
+// loopi at iteration k + t overlap when d - sizei < s * t < d + sizej, where
+// d is the distance between the start addresses. A t >= 1 is a negative
+// distance: loopj would touch memory before loopi, which used to complete
+// first, got to it. Pairs whose distance cannot be computed are unsafe.
+bool LoopFusion::isAccessPairSafe(ScalarEvolution& SE, AAResults& AA, Instruction* accessi, Instruction* accessj, Loop* loopi,
+                                  Loop* loopj) const {
+    Value* pointeri = getLoadStorePointerOperand(accessi);
+    Value* pointerj = getLoadStorePointerOperand(accessj);
+    if (AA.isNoAlias(MemoryLocation::getBeforeOrAfter(getUnderlyingObject(pointeri)),
+                     MemoryLocation::getBeforeOrAfter(getUnderlyingObject(pointerj))))
+        return true;
+
+    const SCEV *starti, *stepi, *startj, *stepj;
+    if (!getAffineAccess(SE, SE.getSCEV(pointeri), loopi, starti, stepi) ||
+        !getAffineAccess(SE, SE.getSCEV(pointerj), loopj, startj, stepj))
+        return false;
+
+    const auto* distance = dyn_cast<SCEVConstant>(SE.getMinusSCEV(startj, starti));
+    const auto* step = dyn_cast<SCEVConstant>(stepi);
+    if (!distance || !step || stepi != stepj)
+        return false;
+
+    const DataLayout& DL = accessi->getModule()->getDataLayout();
+    int64_t sizei = DL.getTypeStoreSize(getLoadStoreType(accessi)).getFixedValue();
+    int64_t sizej = DL.getTypeStoreSize(getLoadStoreType(accessj)).getFixedValue();
+    int64_t d = distance->getAPInt().getSExtValue();
+    int64_t s = step->getAPInt().getSExtValue();
+
+    if (s == 0)
+        return d + sizej <= 0 || d - sizei >= 0;
+
+    // Mirrored, a negative step is a positive one with the interval reversed.
+    if (s < 0) {
+        s = -s;
+        d = -d;
+        std::swap(sizei, sizej);
+    }
+    int64_t t = std::max<int64_t>(1, floorDiv(d - sizei, s) + 1);
+    return s * t >= d + sizej;
+}
+
+// Only loads and stores are analyzed: any other instruction touching memory
+// makes the pair unsafe. Pairs of loads never conflict.
+bool LoopFusion::checkNegativeDistanceDeps(ScalarEvolution& SE, AAResults& AA, Loop* loopi, Loop* loopj) const {
+    auto collectAccesses = [](Loop* loop, std::vector<Instruction*>& accesses) {
+        for (BasicBlock* bb : loop->blocks()) {
+            for (Instruction& inst : *bb) {
+                if (isa<LoadInst>(inst) || isa<StoreInst>(inst)) {
+                    if (inst.isVolatile() || inst.isAtomic())
+                        return false;
+                    accesses.push_back(&inst);
+                } else if (inst.mayReadOrWriteMemory()) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    };
+
+    std::vector<Instruction*> accessesi, accessesj;
+    if (!collectAccesses(loopi, accessesi) || !collectAccesses(loopj, accessesj))
+        return false;
+
+    for (Instruction* accessi : accessesi) {
+        for (Instruction* accessj : accessesj) {
+            if (isa<LoadInst>(accessi) && isa<LoadInst>(accessj))
+                continue;
+            if (!isAccessPairSafe(SE, AA, accessi, accessj, loopi, loopj))
+                return false;
+        }
+    }
+    return true;
+}
+
+// Empties the preheader of loopj, which is also the exit of the loop before
+// it. Each instruction is hoisted into the preheader of hoistLoop, the first
+// loop of the chain being fused, or else sunk into the exit of loopj, when
+// CodeMoverUtils finds it independent of the code it moves across.
+bool LoopFusion::moveInterveningCode(DominatorTree& DT, PostDominatorTree& PT, DependenceInfo& DI, Loop* hoistLoop, Loop* loopj) const {
+    BasicBlock* preheader = loopj->getLoopPreheader();
+    BasicBlock* exitBlock = loopj->getExitBlock();
+    if (!exitBlock)
+        return false;
+
+    FoldSingleEntryPHINodes(preheader);
+    std::vector<Instruction*> intervening;
+    for (Instruction& inst : *preheader) {
+        if (!inst.isTerminator())
+            intervening.push_back(&inst);
+    }
+
+    Instruction* hoistPoint = hoistLoop->getLoopPreheader()->getTerminator();
+    std::vector<Instruction*> toSink;
+    for (Instruction* inst : intervening) {
+        if (isSafeToMoveBefore(*inst, *hoistPoint, DT, &PT, &DI))
+            inst->moveBefore(hoistPoint);
+        else
+            toSink.push_back(inst);
+    }
+
+    // In reverse order every sunk instruction stays ahead of its users.
+    Instruction* sinkPoint = &*exitBlock->getFirstInsertionPt();
+    for (Instruction* inst : reverse(toSink)) {
+        if (!isSafeToMoveBefore(*inst, *sinkPoint, DT, &PT, &DI))
+            return false;
+        inst->moveBefore(sinkPoint);
+        sinkPoint = inst;
+    }
+    return true;
+}
+
+static cl::opt<unsigned> fusionCacheSize("custom-loopfusion-cache-size", cl::init(0), cl::Hidden,
+                                         cl::desc("Bytes of the cache that fused loops should reuse data from "
+                                                  "(0 asks the target for its L1 data cache)"));
+
+static cl::opt<unsigned> fusionCacheLineSize("custom-loopfusion-cache-line-size", cl::init(0), cl::Hidden,
+                                             cl::desc("Bytes of a cache line (0 asks the target)"));
+
+// Weights of the profitability estimate, in instructions per iteration: the
+// control of a loop that disappears, an array reread from the cache instead
+// of memory, and the share of a vectorizable body that is lost when it is
+// fused with a loop that cannot be vectorized.
+static constexpr int loopControlBenefit = 2;
+static constexpr int cacheReuseBenefit = 4;
+static constexpr int vectorizationLossDivisor = 2;
+
+struct LoopFootprint {
+    SmallPtrSet<const Value*, 8> objects;
+    uint64_t iterationBytes = 0;
+    uint64_t bytes = 0;
+};
+
+// The bytes one iteration of the loop touches, each address counted once and
+// those of inner loops once per inner iteration, and the bytes of the whole
+// loop. A trip count that is not a known constant saturates the estimate.
+static LoopFootprint computeFootprint(const Loop* loop, LoopInfo& LI, ScalarEvolution& SE, const DataLayout& DL) {
+    auto getTripCount = [&](const Loop* L) -> uint64_t {
+        unsigned tripCount = SE.getSmallConstantTripCount(L);
+        return tripCount ? tripCount : std::numeric_limits<uint64_t>::max();
+    };
+
+    LoopFootprint footprint;
+    SmallPtrSet<const SCEV*, 16> addresses;
+    for (BasicBlock* bb : loop->blocks()) {
+        for (Instruction& inst : *bb) {
+            Value* pointer = getLoadStorePointerOperand(&inst);
+            if (!pointer || !addresses.insert(SE.getSCEV(pointer)).second)
+                continue;
+            footprint.objects.insert(getUnderlyingObject(pointer));
+            uint64_t bytes = DL.getTypeStoreSize(getLoadStoreType(&inst));
+            for (const Loop* L = LI.getLoopFor(bb); L != loop; L = L->getParentLoop())
+                bytes = SaturatingMultiply(bytes, getTripCount(L));
+            footprint.iterationBytes = SaturatingAdd(footprint.iterationBytes, bytes);
+        }
+    }
+    footprint.bytes = SaturatingMultiply(footprint.iterationBytes, getTripCount(loop));
+    return footprint;
+}
+
+// Values the loop keeps in registers: its header phis and the values defined
+// outside of it that its instructions use.
+static void collectLiveValues(const Loop* loop, SmallPtrSetImpl<const Value*>& liveValues) {
+    for (PHINode& phi : loop->getHeader()->phis())
+        liveValues.insert(&phi);
+    for (BasicBlock* bb : loop->blocks()) {
+        for (Instruction& inst : *bb) {
+            for (const Value* operand : inst.operand_values()) {
+                const Instruction* operandInst = dyn_cast<Instruction>(operand);
+                if (isa<Argument>(operand) || (operandInst && !loop->contains(operandInst)))
+                    liveValues.insert(operand);
+            }
+        }
+    }
+}
+
+// A cheap guess of what the loop vectorizer accepts: an innermost loop with a
+// preheader, a single latch and a single exit, no calls other than intrinsics
+// and only inductions and reductions in its header. Returns the size of the
+// loop body, or 0.
+static unsigned getVectorizableSize(Loop* loop, ScalarEvolution& SE) {
+    if (!loop->isInnermost() || !loop->getLoopPreheader() || !loop->getLoopLatch() || !loop->getExitingBlock())
+        return 0;
+    for (PHINode& phi : loop->getHeader()->phis()) {
+        InductionDescriptor induction;
+        RecurrenceDescriptor reduction;
+        if (!InductionDescriptor::isInductionPHI(&phi, loop, &SE, induction) && !RecurrenceDescriptor::isReductionPHI(&phi, loop, reduction))
+            return 0;
+    }
+    unsigned size = 0;
+    for (BasicBlock* bb : loop->blocks()) {
+        for (Instruction& inst : *bb) {
+            if (isa<CallBase>(inst) && !isa<IntrinsicInst>(inst))
+                return 0;
+            size += !inst.isDebugOrPseudoInst();
+        }
+    }
+    return size;
+}
+
+// Splits a chain of loops, each legally fusable with the next, into the runs
+// of loops to fuse together. A run is legal when the dependences of every
+// pair of its loops allow fusion and its live values fit the registers of the
+// target; among the legal splits the one with the largest estimated benefit
+// is found by dynamic programming on the end of the last run.
+//
+// A run is only worth fusing when every loop after the first one rereads from
+// the cache an array that an earlier loop of the run accessed. Unfused, about
+// a whole loop of data is touched between the two accesses; fused, a single
+// iteration of the loops in between. The reuse improves when the latter fits
+// the cache and the former does not, and the run keeps a line of each of its
+// arrays resident.
+std::vector<std::pair<size_t, size_t>> LoopFusion::partitionChain(const std::vector<Loop*>& chain, ScalarEvolution& SE, AAResults& AA,
+                                                                  LoopInfo& LI, const TargetTransformInfo& TTI) const {
+    unsigned registers = TTI.getNumberOfRegisters(TTI.getRegisterClassForType(false));
+    uint64_t cacheSize = fusionCacheSize ? fusionCacheSize : TTI.getCacheSize(TargetTransformInfo::CacheLevel::L1D).value_or(32 * 1024);
+    uint64_t cacheLineSize = fusionCacheLineSize ? fusionCacheLineSize : TTI.getCacheLineSize();
+    if (!cacheLineSize)
+        cacheLineSize = 64;
+
+    size_t n = chain.size();
+    const DataLayout& DL = chain.front()->getHeader()->getModule()->getDataLayout();
+    std::vector<unsigned> vectorizableSize;
+    std::vector<LoopFootprint> footprints;
+    for (Loop* loop : chain) {
+        vectorizableSize.push_back(getVectorizableSize(loop, SE));
+        footprints.push_back(computeFootprint(loop, LI, SE, DL));
+    }
+
+    auto isReuseImproved = [&](size_t prev, size_t next) {
+        uint64_t unfused = SaturatingAdd(footprints[prev].bytes / 2, footprints[next].bytes / 2);
+        uint64_t fused = 0;
+        for (size_t k = prev; k <= next; k++) {
+            fused = SaturatingAdd(fused, footprints[k].iterationBytes);
+            if (k != prev && k != next)
+                unfused = SaturatingAdd(unfused, footprints[k].bytes);
+        }
+        return fused <= cacheSize && unfused > cacheSize;
+    };
+
+    auto getBenefit = [&](size_t first, size_t last) -> std::optional<int> {
+        int benefit = 0;
+        bool allVectorizable = vectorizableSize[first] != 0;
+        SmallPtrSet<const Value*, 16> objects(footprints[first].objects.begin(), footprints[first].objects.end());
+        for (size_t k = first + 1; k <= last; k++) {
+            unsigned reuses = 0;
+            for (const Value* object : footprints[k].objects) {
+                // Measured from the last earlier loop that accessed the object.
+                for (size_t prev = k; prev-- > first;) {
+                    if (footprints[prev].objects.count(object)) {
+                        reuses += isReuseImproved(prev, k);
+                        break;
+                    }
+                }
+            }
+            if (!reuses)
+                return std::nullopt;
+            benefit += loopControlBenefit + cacheReuseBenefit * reuses;
+            objects.insert(footprints[k].objects.begin(), footprints[k].objects.end());
+            allVectorizable &= vectorizableSize[k] != 0;
+        }
+        if (objects.size() * cacheLineSize > cacheSize)
+            return std::nullopt;
+        if (!allVectorizable) {
+            for (size_t k = first; k <= last; k++)
+                benefit -= vectorizableSize[k] / vectorizationLossDivisor;
+        }
+        return benefit;
+    };
+
+    std::vector<int> best(n + 1, 0);
+    std::vector<size_t> lastRunStart(n + 1);
+    for (size_t last = 0; last < n; last++) {
+        best[last + 1] = best[last];
+        lastRunStart[last + 1] = last;
+
+        // The fused loop keeps a single induction variable.
+        SmallPtrSet<const Value*, 16> liveValues;
+        collectLiveValues(chain[last], liveValues);
+        for (size_t first = last; first-- > 0;) {
+            collectLiveValues(chain[first], liveValues);
+            if (registers && liveValues.size() - (last - first) > registers)
+                break;
+            // Consecutive loops were checked when the chain was built.
+            bool legal = true;
+            for (size_t k = first + 2; k <= last && legal; k++)
+                legal = checkNegativeDistanceDeps(SE, AA, chain[first], chain[k]);
+            if (!legal)
+                break;
+
+            std::optional<int> benefit = getBenefit(first, last);
+            if (benefit && best[first] + *benefit > best[last + 1]) {
+                best[last + 1] = best[first] + *benefit;
+                lastRunStart[last + 1] = first;
+            }
+        }
+    }
+
+    std::vector<std::pair<size_t, size_t>> runs;
+    for (size_t end = n; end > 0; end = lastRunStart[end]) {
+        if (lastRunStart[end] != end - 1)
+            runs.emplace_back(lastRunStart[end], end - 1);
+    }
+    std::reverse(runs.begin(), runs.end());
+    return runs;
+}
+
 bool LoopFusion::mergeLoops(Loop* loopFused, Loop* loopToFuse, ScalarEvolution& SE, LoopInfo& LI) const {
     PHINode* loopToFuseIndV = getInductionVariable(loopToFuse, SE);
     PHINode* loopFusedIndV = getInductionVariable(loopFused, SE);
@@ -86,7 +723,25 @@ bool LoopFusion::mergeLoops(Loop* loopFused, Loop* loopToFuse, ScalarEvolution&
     if (!loopToFuseIndV || !loopFusedIndV)
         return false;
 
-    loopToFuseIndV->replaceAllUsesWith(loopFusedIndV);
+    // The induction variables may differ in type, start and step: the one of
+    // the loop to fuse is rewritten as an affine function of the iteration
+    // count of the fused loop, which SCEVExpander materializes as a canonical
+    // 0-based unit-step counter. Its start and step must be available there.
+    const SCEVAddRecExpr* toFuseRec = dyn_cast<SCEVAddRecExpr>(SE.getSCEV(loopToFuseIndV));
+    if (!toFuseRec)
+        return false;
+    const SCEV* normalizedIndV = SE.getAddRecExpr(toFuseRec->getStart(), toFuseRec->getStepRecurrence(SE), loopFused, SCEV::FlagAnyWrap);
+    BasicBlock* primaryHeader = loopFused->getHeader();
+    if (!SE.properlyDominates(normalizedIndV, primaryHeader))
+        return false;
+
+    Value* fusedIndV = loopFusedIndV;
+    if (normalizedIndV != SE.getSCEV(loopFusedIndV)) {
+        SCEVExpander expander(SE, primaryHeader->getModule()->getDataLayout(), "fusion");
+        fusedIndV = expander.expandCodeFor(normalizedIndV, loopToFuseIndV->getType(), primaryHeader->getFirstNonPHI());
+    }
+    loopToFuseIndV->replaceAllUsesWith(fusedIndV);
+    loopToFuseIndV->eraseFromParent();
     loopFused->getHeader()->getTerminator()->replaceSuccessorWith(loopFused->getExitBlock(), loopToFuse->getExitBlock());
 
     BasicBlock* entryToSecondaryBody = nullptr;
@@ -94,6 +749,16 @@ bool LoopFusion::mergeLoops(Loop* loopFused, Loop* loopToFuse, ScalarEvolution&
     BasicBlock* secondaryLatch = loopToFuse->getLoopLatch();
     BasicBlock* primaryLatch = loopFused->getLoopLatch();
 
+    // The other header phis, e.g. reductions and the values kept for after the
+    // loop, go on in the fused header.
+    BasicBlock* secondaryPreheader = loopToFuse->getLoopPreheader();
+    for (PHINode& phi : make_early_inc_range(secondaryHeader->phis())) {
+        phi.moveBefore(primaryHeader->getFirstNonPHI());
+        phi.replaceIncomingBlockWith(secondaryPreheader, loopFused->getLoopPreheader());
+        phi.replaceIncomingBlockWith(secondaryLatch, primaryLatch);
+    }
+    loopToFuse->getExitBlock()->replacePhiUsesWith(secondaryHeader, primaryHeader);
+
     for (BasicBlock* succ : successors(secondaryHeader)) {
         if (loopToFuse->contains(succ)) {
             entryToSecondaryBody = succ;
@@ -109,9 +774,11 @@ bool LoopFusion::mergeLoops(Loop* loopFused, Loop* loopToFuse, ScalarEvolution&
         pred->getTerminator()->replaceSuccessorWith(secondaryLatch, primaryLatch);
     }
 
-    loopToFuse->getHeader()->getTerminator()->replaceSuccessorWith(entryToSecondaryBody, secondaryLatch);
+    secondaryHeader->getTerminator()->eraseFromParent();
+    BranchInst::Create(secondaryLatch, secondaryHeader);
 
-    for (auto& bb : loopToFuse->blocks()) {
+    std::vector<BasicBlock*> secondaryBlocks(loopToFuse->block_begin(), loopToFuse->block_end());
+    for (BasicBlock* bb : secondaryBlocks) {
         if (bb != secondaryHeader && bb != secondaryLatch) {
             loopFused->addBasicBlockToLoop(bb, LI);
             loopToFuse->removeBlockFromLoop(bb);
@@ -124,6 +791,8 @@ bool LoopFusion::mergeLoops(Loop* loopFused, Loop* loopToFuse, ScalarEvolution&
         loopFused->addChildLoop(child);
     }
 
+    SE.forgetLoop(loopToFuse);
+    SE.forgetLoop(loopFused);
     LI.erase(loopToFuse);
 
     return true;
@@ -134,45 +803,99 @@ PreservedAnalyses LoopFusion::run(Function& function, FunctionAnalysisManager& f
     DominatorTree& DT = fam.getResult<DominatorTreeAnalysis>(function);
     ScalarEvolution& SE = fam.getResult<ScalarEvolutionAnalysis>(function);
     LoopInfo& loopInfo = fam.getResult<LoopAnalysis>(function);
+    AAResults& AA = fam.getResult<AAManager>(function);
+    DependenceInfo& DI = fam.getResult<DependenceAnalysis>(function);
+    const TargetTransformInfo& TTI = fam.getResult<TargetIRAnalysis>(function);
+    OptimizationRemarkEmitter& ORE = fam.getResult<OptimizationRemarkEmitterAnalysis>(function);
+    AssumptionCache& AC = fam.getResult<AssumptionAnalysis>(function);
     const std::vector<Loop*>& topLevelLoops = loopInfo.getTopLevelLoops();
     const std::vector<Loop*>& topLevelLoopsInPreorder = std::vector(topLevelLoops.rbegin(), topLevelLoops.rend());
     std::vector<std::pair<Loop*, Loop*>> adjacentLoops;
 
+    bool changed = canonicalizeLoops(topLevelLoopsInPreorder, DT, loopInfo, SE, AC, AA, TTI);
+    PT.recalculate(function);
     findAdjacentLoops(topLevelLoopsInPreorder, adjacentLoops);
 
-    const auto& loopsToMerge = make_filter_range(adjacentLoops, [this, &PT, &DT, &SE](std::pair<Loop*, Loop*> pair) {
+    std::vector<std::pair<Loop*, Loop*>> loopsToMergeVector;
+    copy_if(adjacentLoops, std::back_inserter(loopsToMergeVector), [&, this](std::pair<Loop*, Loop*> pair) {
+        if (!isInFusionForm(pair.first, DT) || !isInFusionForm(pair.second, DT)) {
+            emitNotFusedRemark(ORE, pair.first, "Loops are not in canonical form");
+            return false;
+        }
+        if (usesLiveOuts(pair.first, pair.second)) {
+            emitNotFusedRemark(ORE, pair.first, "Second loop uses values computed by the first one");
+            return false;
+        }
         if (!haveSameTripCount(SE, pair.first, pair.second)) {
-            errs() << "Loops do not have the same trip count\n";
+            emitNotFusedRemark(ORE, pair.first, "Loops do not have the same trip count");
             return false;
         }
         if (!areControlFlowEquivalent(DT, PT, pair.first, pair.second)) {
-            errs() << "Loops are not control flow equivalent\n";
+            emitNotFusedRemark(ORE, pair.first, "Loops are not control flow equivalent");
             return false;
         }
-        if (!checkNegativeDistanceDeps(pair.first, pair.second)) {
-            errs() << "Loops have negative distance dependencies\n";
+        if (!checkNegativeDistanceDeps(SE, AA, pair.first, pair.second)) {
+            emitNotFusedRemark(ORE, pair.first, "Loops may have negative distance dependencies");
             return false;
         }
         return true;
     });
 
-    std::vector<std::pair<Loop*, Loop*>> loopsToMergeVector(loopsToMerge.begin(), loopsToMerge.end());
-
-    for (Loop* l : topLevelLoops)
-        outs() << *l << '\n';
-
-    for (int i = 0; i < loopsToMergeVector.size(); i++) {
-        bool merged = mergeLoops(loopsToMergeVector[i].first, loopsToMergeVector[i].second, SE, loopInfo);
+    // Pairs sharing a loop form chains, which are then split into the runs
+    // of loops worth fusing.
+    std::vector<std::vector<Loop*>> chains;
+    for (auto [loopi, loopj] : loopsToMergeVector) {
+        if (chains.empty() || chains.back().back() != loopi)
+            chains.push_back({loopi});
+        chains.back().push_back(loopj);
+    }
 
-        if (merged && i != loopsToMergeVector.size() - 1 && loopsToMergeVector[i].second == loopsToMergeVector[i + 1].first) {
-            loopsToMergeVector[i + 1].first = loopsToMergeVector[i].first;
+    // Only the runs worth fusing are made adjacent. The preheader of the first
+    // loop of a run is the only one left in place, so the code in between is
+    // hoisted there; a pair whose code cannot be moved splits the run. All
+    // the code is moved before any loop is merged.
+    std::vector<std::vector<Loop*>> runsToMerge;
+    for (const std::vector<Loop*>& chain : chains) {
+        std::vector<std::pair<size_t, size_t>> runs = partitionChain(chain, SE, AA, loopInfo, TTI);
+        for (size_t k = 0, run = 0; k + 1 < chain.size(); k++) {
+            while (run < runs.size() && runs[run].second <= k)
+                run++;
+            if (run == runs.size() || runs[run].first > k)
+                emitNotFusedRemark(ORE, chain[k], "Fusion does not improve cache reuse");
+        }
+        for (auto [first, last] : runs) {
+            size_t start = first;
+            for (size_t k = first + 1; k <= last; k++) {
+                // The code may have moved even if not all of it could.
+                changed = true;
+                if (moveInterveningCode(DT, PT, DI, chain[start], chain[k]))
+                    continue;
+                emitNotFusedRemark(ORE, chain[k - 1], "Code between the loops cannot be moved");
+                if (start != k - 1)
+                    runsToMerge.emplace_back(chain.begin() + start, chain.begin() + k);
+                start = k;
+            }
+            if (start != last)
+                runsToMerge.emplace_back(chain.begin() + start, chain.begin() + last + 1);
         }
     }
 
-    for (Loop* l : loopInfo.getTopLevelLoops())
-        outs() << *l << '\n';
+    for (const std::vector<Loop*>& run : runsToMerge) {
+        Loop* loopFused = run.front();
+        for (Loop* loopToFuse : drop_begin(run)) {
+            if (!mergeLoops(loopFused, loopToFuse, SE, loopInfo)) {
+                loopFused = loopToFuse;
+                continue;
+            }
+            changed = true;
+            ORE.emit([&] {
+                return OptimizationRemark(DEBUG_TYPE, "Fused", loopFused->getStartLoc(), loopFused->getHeader())
+                       << "loop fused with the adjacent loop that follows it";
+            });
+        }
+    }
 
-    return PreservedAnalyses::none();
+    return changed ? PreservedAnalyses::none() : PreservedAnalyses::all();
 }
 
 extern "C" PassPluginLibraryInfo llvmGetPassPluginInfo() {
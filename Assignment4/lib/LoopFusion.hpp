@@ -1,9 +1,13 @@
 #pragma once // NOLINT(llvm-header-guard)
 
 #include <concepts>
+#include <llvm/Analysis/AliasAnalysis.h>
+#include <llvm/Analysis/AssumptionCache.h>
+#include <llvm/Analysis/DependenceAnalysis.h>
 #include <llvm/Analysis/LoopInfo.h>
 #include <llvm/Analysis/PostDominators.h>
 #include <llvm/Analysis/ScalarEvolution.h>
+#include <llvm/Analysis/TargetTransformInfo.h>
 #include <llvm/IR/BasicBlock.h>
 #include <llvm/IR/Constants.h>
 #include <llvm/IR/Dominators.h>
@@ -15,11 +19,20 @@
 class LoopFusion : public llvm::PassInfoMixin<LoopFusion>
 {
   private:
+    bool canonicalizeLoops(const std::vector<llvm::Loop*>& loops, llvm::DominatorTree& DT, llvm::LoopInfo& LI, llvm::ScalarEvolution& SE,
+                           llvm::AssumptionCache& AC, llvm::AAResults& AA, const llvm::TargetTransformInfo& TTI) const;
     bool areLoopsAdjacent(const llvm::Loop*, const llvm::Loop*) const;
     void findAdjacentLoops(const std::vector<llvm::Loop*>& loops, std::vector<std::pair<llvm::Loop*, llvm::Loop*>>& adjLoopPairs) const;
     bool haveSameTripCount(llvm::ScalarEvolution& SE, llvm::Loop const* loopi, llvm::Loop const* loopj) const;
     bool areControlFlowEquivalent(llvm::DominatorTree& DT, llvm::PostDominatorTree& PT, const llvm::Loop* loopi, const llvm::Loop* loopj) const;
-    bool checkNegativeDistanceDeps(llvm::Loop* loopi, llvm::Loop* loopj) const;
+    bool checkNegativeDistanceDeps(llvm::ScalarEvolution& SE, llvm::AAResults& AA, llvm::Loop* loopi, llvm::Loop* loopj) const;
+    bool isAccessPairSafe(llvm::ScalarEvolution& SE, llvm::AAResults& AA, llvm::Instruction* accessi, llvm::Instruction* accessj,
+                          llvm::Loop* loopi, llvm::Loop* loopj) const;
+    bool moveInterveningCode(llvm::DominatorTree& DT, llvm::PostDominatorTree& PT, llvm::DependenceInfo& DI, llvm::Loop* hoistLoop,
+                             llvm::Loop* loopj) const;
+    std::vector<std::pair<size_t, size_t>> partitionChain(const std::vector<llvm::Loop*>& chain, llvm::ScalarEvolution& SE,
+                                                          llvm::AAResults& AA, llvm::LoopInfo& LI,
+                                                          const llvm::TargetTransformInfo& TTI) const;
     bool mergeLoops(llvm::Loop* loopFused, llvm::Loop* loopToFuse, llvm::ScalarEvolution& SE, llvm::LoopInfo& LI) const;
     llvm::PHINode* getInductionVariable(llvm::Loop* L, llvm::ScalarEvolution& SE) const;
 
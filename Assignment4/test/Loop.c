@@ -1,6 +1,8 @@
+#ifndef ARRAY_SIZE
 #define ARRAY_SIZE 1000
+#endif
 
-void populate(int a[ARRAY_SIZE], int b[ARRAY_SIZE], int c[ARRAY_SIZE]) {
+void populate(int a[restrict ARRAY_SIZE], int b[restrict ARRAY_SIZE], int c[restrict ARRAY_SIZE]) {
     for (int i = 0; i < ARRAY_SIZE; i++) {
         a[i] = i;
     }
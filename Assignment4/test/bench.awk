@@ -0,0 +1,72 @@
+# Riassume le righe "ARRAY_SIZE binario cicli istruzioni L1D-miss LLC-miss"
+# prodotte dal target bench: media di ogni contatore con l'intervallo di
+# confidenza al 95% (t di Student) e il rapporto main-opt / main.
+
+BEGIN {
+    split("12.706 4.303 3.182 2.776 2.571 2.447 2.365 2.306 2.262 2.228 " \
+          "2.201 2.179 2.160 2.145 2.131 2.120 2.110 2.101 2.093 2.086 " \
+          "2.080 2.074 2.069 2.064 2.060 2.056 2.052 2.048 2.045 2.042", t95, " ")
+    split("cycles instructions L1D-misses LLC-misses", names, " ")
+    metrics = 4
+}
+
+{
+    if (!($1 in seen)) {
+        seen[$1] = 1
+        sizes[++nsizes] = $1
+    }
+    for (m = 1; m <= metrics; m++) {
+        v = $(m + 2)
+        if (v == "-") {
+            continue
+        }
+        k = $1 SUBSEP $2 SUBSEP m
+        n[k]++
+        sum[k] += v
+        sumsq[k] += v * v
+    }
+}
+
+function mean(k) {
+    return n[k] ? sum[k] / n[k] : 0
+}
+
+function ci(k,    df, var) {
+    df = n[k] - 1
+    if (df < 1) {
+        return 0
+    }
+    var = (sumsq[k] - sum[k] * sum[k] / n[k]) / df
+    return (df <= 30 ? t95[df] : 1.960) * sqrt(var > 0 ? var : 0) / sqrt(n[k])
+}
+
+function cell(k) {
+    return n[k] ? sprintf("%.4g +/- %.1f%%", mean(k), mean(k) ? 100 * ci(k) / mean(k) : 0) : "n/a"
+}
+
+END {
+    printf "%-10s %-10s", "ARRAY_SIZE", "binary"
+    for (m = 1; m <= metrics; m++) {
+        printf " %-22s", names[m]
+    }
+    printf "\n"
+
+    for (s = 1; s <= nsizes; s++) {
+        size = sizes[s]
+        split("main main-opt", bins, " ")
+        for (b = 1; b <= 2; b++) {
+            printf "%-10s %-10s", size, bins[b]
+            for (m = 1; m <= metrics; m++) {
+                printf " %-22s", cell(size SUBSEP bins[b] SUBSEP m)
+            }
+            printf "\n"
+        }
+        printf "%-10s %-10s", size, "opt/base"
+        for (m = 1; m <= metrics; m++) {
+            base = size SUBSEP "main" SUBSEP m
+            fused = size SUBSEP "main-opt" SUBSEP m
+            printf " %-22s", (n[base] && n[fused] && mean(base)) ? sprintf("%.3f", mean(fused) / mean(base)) : "n/a"
+        }
+        printf "\n"
+    }
+}
@@ -1,12 +1,22 @@
 #include <stdio.h>
 
+#ifndef ARRAY_SIZE
 #define ARRAY_SIZE 1000
+#endif
 
-void populate(int a[ARRAY_SIZE], int b[ARRAY_SIZE], int c[ARRAY_SIZE]);
+// Volte in cui populate viene chiamata, per misurare array piccoli su tempi misurabili
+#ifndef REPEAT
+#define REPEAT 1
+#endif
+
+void populate(int a[restrict ARRAY_SIZE], int b[restrict ARRAY_SIZE], int c[restrict ARRAY_SIZE]);
 
 int main(void) {
-    int a[ARRAY_SIZE], b[ARRAY_SIZE], c[ARRAY_SIZE];
-    populate(a, b, c);
+    // Statici perché con gli ARRAY_SIZE del benchmark non starebbero nello stack
+    static int a[ARRAY_SIZE], b[ARRAY_SIZE], c[ARRAY_SIZE];
+    for (int r = 0; r < REPEAT; r++) {
+        populate(a, b, c);
+    }
     
     // Stampa qualche valore per verificare il corretto funzionamento
     printf("a[0] = %d, b[0] = %d, c[0] = %d\n", a[0], b[0], c[0]);
@@ -0,0 +1,110 @@
+// Esegue un programma con i contatori hardware di perf_event_open e stampa su
+// una riga cicli, istruzioni, miss in lettura della L1 dati e miss dell'ultimo
+// livello di cache, contati solo in user space. I contatori che la macchina
+// non offre vengono stampati come "-".
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define CACHE_MISS(cache) ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const struct {
+    uint32_t type;
+    uint64_t config;
+} events[] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_L1D)},
+    {PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_LL)},
+};
+
+#define EVENT_COUNT (sizeof(events) / sizeof(events[0]))
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "uso: %s programma [argomenti...]\n", argv[0]);
+        return 2;
+    }
+
+    // Il figlio aspetta che i contatori siano aperti prima di fare exec
+    int ready[2];
+    if (pipe(ready) != 0) {
+        perror("pipe");
+        return 1;
+    }
+
+    pid_t child = fork();
+    if (child < 0) {
+        perror("fork");
+        return 1;
+    }
+    if (child == 0) {
+        char c;
+        close(ready[1]);
+        if (read(ready[0], &c, 1) != 1) {
+            _exit(127);
+        }
+        // L'output del programma si mescolerebbe ai conteggi
+        int devnull = open("/dev/null", O_WRONLY);
+        if (devnull >= 0) {
+            dup2(devnull, STDOUT_FILENO);
+        }
+        execv(argv[1], argv + 1);
+        perror(argv[1]);
+        _exit(127);
+    }
+    close(ready[0]);
+
+    // I contatori partono all'exec, così fork e attesa non vengono contati
+    int fds[EVENT_COUNT];
+    int opened = 0;
+    for (size_t i = 0; i < EVENT_COUNT; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[i].type;
+        attr.config = events[i].config;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        attr.disabled = 1;
+        attr.enable_on_exec = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fds[i] = syscall(SYS_perf_event_open, &attr, child, -1, -1, 0);
+        opened += fds[i] >= 0;
+    }
+    if (opened == 0) {
+        fprintf(stderr, "%s: nessun contatore hardware disponibile (vedi /proc/sys/kernel/perf_event_paranoid)\n", argv[0]);
+    }
+
+    if (write(ready[1], "", 1) != 1) {
+        perror("write");
+    }
+    close(ready[1]);
+
+    int status;
+    if (waitpid(child, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "%s: %s non è terminato correttamente\n", argv[0], argv[1]);
+        return 1;
+    }
+
+    for (size_t i = 0; i < EVENT_COUNT; i++) {
+        // value, time_enabled, time_running: se i contatori sono stati
+        // multiplexati il conteggio viene scalato sul tempo totale
+        uint64_t counts[3];
+        if (fds[i] < 0 || read(fds[i], counts, sizeof(counts)) != sizeof(counts) || counts[2] == 0) {
+            printf("%s-", i ? " " : "");
+        } else {
+            double value = (double)counts[0] * counts[1] / counts[2];
+            printf("%s%.0f", i ? " " : "", value);
+        }
+    }
+    printf("\n");
+
+    return opened ? 0 : 1;
+}
@@ -242,6 +242,7 @@
 #include "llvm/Transforms/Utils/LibCallsShrinkWrap.h"
 #include "llvm/Transforms/Utils/LocalOpts.hpp"
 #include "llvm/Transforms/Utils/LoopAnalysisPass.hpp"
+#include "llvm/Transforms/Utils/LoopDistributionPass.hpp"
 #include "llvm/Transforms/Utils/LoopFusion_V2.h"
 #include "llvm/Transforms/Utils/LoopFusion_V3.hpp"
 #include "llvm/Transforms/Utils/LoopFusion.h"
@@ -0,0 +1,51 @@
+#ifndef LLVM_TRANSFORMS_LOOPDEPENDENCEINDEX_H
+#define LLVM_TRANSFORMS_LOOPDEPENDENCEINDEX_H
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/DependenceAnalysis.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ValueTracking.h"
+
+namespace llvm {
+
+// Memory accesses of the loops of a function, grouped by underlying object
+// and split into reads and writes. Two loops are independent if no write of
+// one depends on an access of the other to the same object: groups of
+// objects that cannot alias are skipped, read-read pairs are never queried,
+// and both the alias answers and the dependence answers are cached for the
+// following queries. A loop must be forgotten once it is changed.
+//
+// Both the fusion and the distribution passes are built on it: the former
+// asks whether two loops are independent, the latter for the directions of
+// the dependences between the accesses of a single loop.
+class LoopDependenceIndex {
+public:
+  LoopDependenceIndex(DependenceInfo &DI, AAResults &AA) : DI(DI), AA(AA) {}
+
+  bool areLoopsIndependent(const Loop *Lprev, const Loop *Lnext);
+  bool mayAlias(const Value *ObjectA, const Value *ObjectB);
+  unsigned getDirections(Instruction *Src, Instruction *Dst);
+  void forgetLoop(const Loop *L);
+
+private:
+  struct AccessGroup {
+    const Value *Object;
+    SmallVector<Instruction *, 4> Reads;
+    SmallVector<Instruction *, 4> Writes;
+  };
+
+  ArrayRef<AccessGroup> getAccessGroups(const Loop *L);
+  bool areGroupsIndependent(const AccessGroup &Prev, const AccessGroup &Next);
+
+  DependenceInfo &DI;
+  AAResults &AA;
+  DenseMap<const Loop *, SmallVector<AccessGroup, 4>> Groups;
+  DenseMap<std::pair<const Value *, const Value *>, bool> ObjectsMayAlias;
+  DenseMap<std::pair<Instruction *, Instruction *>, unsigned> Dependences;
+};
+} // namespace llvm
+
+#endif // LLVM_TRANSFORMS_LOOPDEPENDENCEINDEX_H
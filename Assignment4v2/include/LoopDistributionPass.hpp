@@ -0,0 +1,53 @@
+#ifndef LLVM_TRANSFORMS_LOOPDISTRIBUTIONPASS_H
+#define LLVM_TRANSFORMS_LOOPDISTRIBUTIONPASS_H
+
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/DependenceAnalysis.h"
+#include "llvm/Analysis/IVDescriptors.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/LoopIterator.h"
+#include "llvm/Analysis/PostDominators.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/LoopDependenceIndex.hpp"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+#include <optional>
+
+namespace llvm {
+
+class LoopDistributionPass : public PassInfoMixin<LoopDistributionPass> {
+public:
+  PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM);
+
+private:
+  // Statements of the loop that end up in the same new loop, together with
+  // every instruction of the loop they need: their operands and the control
+  // flow of the loop, which each new loop computes again.
+  struct Partition {
+    SmallVector<Instruction *, 8> Statements;
+    SmallPtrSet<Instruction *, 16> Slice;
+    bool Vectorizable;
+  };
+
+  bool canDistribute(const Loop *L, DominatorTree &DT) const;
+  void getSlice(const Loop *L, Instruction *I,
+                SmallPtrSetImpl<Instruction *> &Slice) const;
+  SmallVector<Partition, 4> partitionLoop(Loop *L, Function &F,
+                                          FunctionAnalysisManager &FAM,
+                                          LoopDependenceIndex &Index) const;
+  void removeOtherInstructions(const Loop *L, const Partition &Part,
+                               ValueToValueMapTy *VMap) const;
+  void distribute(Loop *L, ArrayRef<Partition> Partitions, Function &F,
+                  FunctionAnalysisManager &FAM,
+                  LoopDependenceIndex &Index) const;
+};
+} // namespace llvm
+
+#endif // LLVM_TRANSFORMS_LOOPDISTRIBUTIONPASS_H
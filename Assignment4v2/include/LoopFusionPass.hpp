@@ -1,35 +1,114 @@
 #ifndef LLVM_TRANSFORMS_LOOPFUSIONPASS_H
 #define LLVM_TRANSFORMS_LOOPFUSIONPASS_H
 
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/AssumptionCache.h"
 #include "llvm/Analysis/DependenceAnalysis.h"
+#include "llvm/Analysis/IVDescriptors.h"
 #include "llvm/Analysis/LoopInfo.h"
 #include "llvm/Analysis/PostDominators.h"
 #include "llvm/Analysis/ScalarEvolution.h"
 #include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/Analysis/ValueTracking.h"
 #include "llvm/IR/Dominators.h"
 #include "llvm/IR/PassManager.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/MathExtras.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/CodeMoverUtils.h"
+#include "llvm/Transforms/Utils/LoopDependenceIndex.hpp"
+#include "llvm/Transforms/Utils/LoopSimplify.h"
+#include "llvm/Transforms/Utils/LoopUtils.h"
+#include "llvm/Transforms/Utils/ScalarEvolutionExpander.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+#include <algorithm>
+#include <limits>
+#include <optional>
 
 namespace llvm {
+
 class LoopFusionPass : public PassInfoMixin<LoopFusionPass> {
 public:
   PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM);
 
 private:
+  // A run of consecutive loops to fuse into the first one, which first loses
+  // the iterations it runs in excess of the others.
+  struct FusionGroup {
+    unsigned First;
+    unsigned Last;
+    // Iterations peeled off the front of the first loop when positive, off
+    // the back of the second one when negative.
+    int PeelCount;
+  };
+
+  struct LoopFootprint {
+    SmallPtrSet<const Value *, 8> Objects;
+    uint64_t IterationBytes = 0;
+    uint64_t Bytes = 0;
+  };
+
+  bool isInFusionForm(const Loop *L, DominatorTree &DT) const;
+  bool testsExitInHeader(const Loop *L) const;
+  bool canCanonicalize(const Loop *L, DominatorTree &DT, ScalarEvolution &SE,
+                       const DataLayout &DL) const;
+  PHINode *getUnrotationIV(const Loop *L, ScalarEvolution &SE,
+                           const DataLayout &DL, const SCEV *&End) const;
+  bool unrotateLoop(Loop *L, Function &F, FunctionAnalysisManager &FAM) const;
+  bool mergeGuards(const Loop *Lprev, const Loop *Lnext, Function &F,
+                   FunctionAnalysisManager &FAM) const;
+  bool canonicalizeLoops(ArrayRef<Loop *> Loops, Function &F,
+                         FunctionAnalysisManager &FAM,
+                         LoopDependenceIndex &Index) const;
+
   BasicBlock *getLoopHead(const Loop *L) const;
   BasicBlock *getLoopExit(const Loop *L) const;
 
   PHINode *getIVForNonRotatedLoops(Loop *L, ScalarEvolution &SE) const;
+  const SCEVAddRecExpr *getNormalizedIV(const Loop *L, PHINode *IV,
+                                        ScalarEvolution &SE) const;
+  bool canNormalizeIVs(Loop *Lprev, Loop *Lnext, ScalarEvolution &SE) const;
 
   bool areLoopsAdjacent(const Loop *Lprev, const Loop *Lnext) const;
+  bool makeLoopsAdjacent(const Loop *Lprev, const Loop *Lnext, Function &F,
+                         FunctionAnalysisManager &FAM, bool &Changed);
+  bool getBackedgeTakenCounts(const Loop *Lprev, const Loop *Lnext,
+                              ScalarEvolution &SE, const SCEV *&LprevTC,
+                              const SCEV *&LnextTC) const;
   bool areLoopsTCE(const Loop *Lprev, const Loop *Lnext, Function &F,
                    FunctionAnalysisManager &FAM) const;
+  bool canPeelFirstIterations(const Loop *L) const;
+  bool canPeelLastIterations(const Loop *L) const;
+  bool getPeelCount(const Loop *Lprev, const Loop *Lnext, Function &F,
+                    FunctionAnalysisManager &FAM, int &PeelCount) const;
+  void peelFirstIterations(Loop *L, unsigned PeelCount, Function &F,
+                           FunctionAnalysisManager &FAM,
+                           LoopDependenceIndex &Index);
+  void peelLastIterations(Loop *L, unsigned PeelCount, Function &F,
+                          FunctionAnalysisManager &FAM,
+                          LoopDependenceIndex &Index);
+  bool usesLiveOuts(const Loop *Lprev, const Loop *Lnext) const;
   bool areLoopsCFE(const Loop *Lprev, const Loop *Lnext, Function &F,
                    FunctionAnalysisManager &FAM) const;
-  bool areLoopsIndependent(const Loop *Lprev, const Loop *Lnext, Function &F,
-                         FunctionAnalysisManager &FAM) const;
   Loop *merge(Loop *Lprev, Loop *Lnext, Function &F,
-              FunctionAnalysisManager &FAM);
+              FunctionAnalysisManager &FAM, LoopDependenceIndex &Index);
+
+  void getLiveValues(const Loop *L,
+                     SmallPtrSetImpl<const Value *> &LiveValues) const;
+  unsigned getVectorizableSize(Loop *L, ScalarEvolution &SE) const;
+  LoopFootprint getFootprint(const Loop *L, LoopInfo &LI, ScalarEvolution &SE,
+                             const DataLayout &DL) const;
+  SmallVector<FusionGroup, 4> partitionLoops(ArrayRef<Loop *> Loops,
+                                             Function &F,
+                                             FunctionAnalysisManager &FAM,
+                                             LoopDependenceIndex &Index,
+                                             bool Tentative) const;
+  bool fuseLoops(ArrayRef<Loop *> Loops, Function &F,
+                 FunctionAnalysisManager &FAM, LoopDependenceIndex &Index);
 };
 } // namespace llvm
 
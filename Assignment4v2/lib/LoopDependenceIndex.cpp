@@ -0,0 +1,102 @@
+#include "llvm/Transforms/Utils/LoopDependenceIndex.hpp"
+
+using namespace llvm;
+
+ArrayRef<LoopDependenceIndex::AccessGroup>
+LoopDependenceIndex::getAccessGroups(const Loop *L) {
+  auto [It, Inserted] = Groups.try_emplace(L);
+  if (!Inserted)
+    return It->second;
+
+  auto &LoopGroups = It->second;
+  DenseMap<const Value *, unsigned> GroupOf;
+  for (auto *BB : L->getBlocks()) {
+    for (auto &I : *BB) {
+      if (!isa<LoadInst>(&I) && !isa<StoreInst>(&I))
+        continue;
+      const Value *Object = getUnderlyingObject(getLoadStorePointerOperand(&I));
+      auto [GroupIt, IsNew] = GroupOf.try_emplace(Object, LoopGroups.size());
+      if (IsNew)
+        LoopGroups.push_back({Object, {}, {}});
+      auto &Group = LoopGroups[GroupIt->second];
+      (isa<StoreInst>(&I) ? Group.Writes : Group.Reads).push_back(&I);
+    }
+  }
+  return LoopGroups;
+}
+
+// Objects are compared as a whole, whatever part of them is accessed.
+bool LoopDependenceIndex::mayAlias(const Value *ObjectA, const Value *ObjectB) {
+  if (ObjectA == ObjectB)
+    return true;
+  auto Key = ObjectA < ObjectB ? std::make_pair(ObjectA, ObjectB)
+                               : std::make_pair(ObjectB, ObjectA);
+  auto [It, Inserted] = ObjectsMayAlias.try_emplace(Key, true);
+  if (Inserted)
+    It->second = !AA.isNoAlias(MemoryLocation::getBeforeOrAfter(ObjectA),
+                               MemoryLocation::getBeforeOrAfter(ObjectB));
+  return It->second;
+}
+
+// The directions, as Dependence::DVEntry bits, of the dependence from Src to
+// Dst at the innermost loop that contains both, or 0 if there is none. A
+// dependence that cannot be analyzed goes in every direction.
+unsigned LoopDependenceIndex::getDirections(Instruction *Src,
+                                            Instruction *Dst) {
+  auto [It, Inserted] =
+      Dependences.try_emplace({Src, Dst}, Dependence::DVEntry::ALL);
+  if (Inserted) {
+    auto Dep = DI.depends(Src, Dst, true);
+    if (!Dep)
+      It->second = Dependence::DVEntry::NONE;
+    else if (Dep->getLevels())
+      It->second = Dep->getDirection(Dep->getLevels());
+  }
+  return It->second;
+}
+
+bool LoopDependenceIndex::areGroupsIndependent(const AccessGroup &Prev,
+                                               const AccessGroup &Next) {
+  for (auto *Write : Prev.Writes) {
+    for (auto *Access : llvm::concat<Instruction *const>(Next.Reads,
+                                                         Next.Writes)) {
+      if (getDirections(Write, Access))
+        return false;
+    }
+  }
+  for (auto *Read : Prev.Reads) {
+    for (auto *Write : Next.Writes) {
+      if (getDirections(Read, Write))
+        return false;
+    }
+  }
+  return true;
+}
+
+bool LoopDependenceIndex::areLoopsIndependent(const Loop *Lprev,
+                                              const Loop *Lnext) {
+  // Building the groups of a loop may move those of the others.
+  (void)getAccessGroups(Lprev);
+  auto NextGroups = getAccessGroups(Lnext);
+  for (const auto &Prev : Groups.find(Lprev)->second) {
+    for (const auto &Next : NextGroups) {
+      if (mayAlias(Prev.Object, Next.Object) &&
+          !areGroupsIndependent(Prev, Next))
+        return false;
+    }
+  }
+  return true;
+}
+
+// The dependences of a changed loop may differ, e.g. once two loops become
+// one the distance between their accesses is carried by a single loop.
+void LoopDependenceIndex::forgetLoop(const Loop *L) {
+  Groups.erase(L);
+  SmallVector<std::pair<Instruction *, Instruction *>, 8> Stale;
+  for (auto &Entry : Dependences) {
+    if (L->contains(Entry.first.first) || L->contains(Entry.first.second))
+      Stale.push_back(Entry.first);
+  }
+  for (auto &Key : Stale)
+    Dependences.erase(Key);
+}
@@ -0,0 +1,300 @@
+#include "llvm/Transforms/Utils/LoopDistributionPass.hpp"
+
+using namespace llvm;
+
+// Every new loop runs the whole control flow of the original one, so the
+// loop is cloned as it is: innermost, in simplified and LCSSA form, with a
+// single exit and no memory access other than simple loads and stores. Every
+// instruction must also pass control to the next one: a call that may throw
+// or never return would otherwise stop only the partition it lands in, after
+// the earlier partitions have already run all of their iterations.
+bool LoopDistributionPass::canDistribute(const Loop *L,
+                                         DominatorTree &DT) const {
+  if (!L->isInnermost() || !L->isLoopSimplifyForm() || !L->getExitBlock() ||
+      !L->isLCSSAForm(DT))
+    return false;
+  for (auto *BB : L->getBlocks()) {
+    for (auto &I : *BB) {
+      if (!isGuaranteedToTransferExecutionToSuccessor(&I))
+        return false;
+      if (auto *Call = dyn_cast<CallBase>(&I)) {
+        if (Call->cannotDuplicate() || Call->isConvergent())
+          return false;
+      }
+      if (isa<LoadInst>(&I) || isa<StoreInst>(&I)) {
+        if (!getLoadStoreType(&I)->isSized() ||
+            (isa<LoadInst>(&I) && !cast<LoadInst>(&I)->isSimple()) ||
+            (isa<StoreInst>(&I) && !cast<StoreInst>(&I)->isSimple()))
+          return false;
+      } else if (I.mayReadOrWriteMemory()) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// The instructions of the loop that compute I, I included.
+void LoopDistributionPass::getSlice(
+    const Loop *L, Instruction *I,
+    SmallPtrSetImpl<Instruction *> &Slice) const {
+  SmallVector<Instruction *, 8> Worklist;
+  if (Slice.insert(I).second)
+    Worklist.push_back(I);
+  while (!Worklist.empty()) {
+    for (auto *Op : Worklist.pop_back_val()->operand_values()) {
+      auto *OpInst = dyn_cast<Instruction>(Op);
+      if (OpInst && L->contains(OpInst) && Slice.insert(OpInst).second)
+        Worklist.push_back(OpInst);
+    }
+  }
+}
+
+// The statements of the loop are its memory accesses and the instructions
+// used after it. The dependence graph has an edge from a statement to every
+// statement that must follow it: a dependence in the same iteration or
+// carried forward goes down the body, one carried backward goes up, and a
+// statement is tied both ways to the loads it uses. Its strongly connected
+// components are the smallest partitions, and a component is cyclic when a
+// dependence carried by the loop joins two of its statements.
+//
+// The components are ordered by their dependences, program order breaking
+// ties, and those that can be vectorized are grouped apart from those that
+// cannot, which are kept as they are. The values used after the loop must be
+// computed by the last partition, which stays in the original loop.
+SmallVector<LoopDistributionPass::Partition, 4>
+LoopDistributionPass::partitionLoop(Loop *L, Function &F,
+                                    FunctionAnalysisManager &FAM,
+                                    LoopDependenceIndex &Index) const {
+  auto &LI = FAM.getResult<LoopAnalysis>(F);
+  auto &SE = FAM.getResult<ScalarEvolutionAnalysis>(F);
+
+  LoopBlocksRPO RPO(L);
+  RPO.perform(&LI);
+  SmallVector<Instruction *, 16> Statements;
+  SmallPtrSet<Instruction *, 4> LiveOuts;
+  SmallPtrSet<Instruction *, 16> ControlSlice;
+  for (auto *BB : RPO) {
+    for (auto &I : *BB) {
+      bool IsLiveOut = any_of(I.users(), [&](User *U) {
+        return !L->contains(cast<Instruction>(U));
+      });
+      if (IsLiveOut)
+        LiveOuts.insert(&I);
+      if (isa<LoadInst>(&I) || isa<StoreInst>(&I) || IsLiveOut)
+        Statements.push_back(&I);
+    }
+    getSlice(L, BB->getTerminator(), ControlSlice);
+  }
+
+  // A statement the control flow depends on would run in every new loop.
+  unsigned N = Statements.size();
+  if (N < 2 || any_of(Statements, [&](Instruction *S) {
+        return ControlSlice.count(S);
+      }))
+    return {};
+
+  SmallVector<SmallPtrSet<Instruction *, 16>, 16> Slices(N);
+  for (unsigned I = 0; I < N; ++I)
+    getSlice(L, Statements[I], Slices[I]);
+
+  SmallVector<BitVector, 16> Reaches(N, BitVector(N));
+  SmallVector<std::pair<unsigned, unsigned>, 8> Carried;
+  for (unsigned I = 0; I < N; ++I) {
+    Reaches[I].set(I);
+    for (unsigned J = I; J < N; ++J) {
+      auto *Src = Statements[I];
+      auto *Dst = Statements[J];
+      if (J != I && (Slices[I].count(Dst) || Slices[J].count(Src))) {
+        Reaches[I].set(J);
+        Reaches[J].set(I);
+      }
+      auto *SrcPtr = getLoadStorePointerOperand(Src);
+      auto *DstPtr = getLoadStorePointerOperand(Dst);
+      if (!SrcPtr || !DstPtr ||
+          (!isa<StoreInst>(Src) && !isa<StoreInst>(Dst)) ||
+          !Index.mayAlias(getUnderlyingObject(SrcPtr),
+                          getUnderlyingObject(DstPtr)))
+        continue;
+      unsigned Directions = Index.getDirections(Src, Dst);
+      if (Directions & (Dependence::DVEntry::LT | Dependence::DVEntry::EQ))
+        Reaches[I].set(J);
+      if (Directions & Dependence::DVEntry::GT)
+        Reaches[J].set(I);
+      if (Directions & (Dependence::DVEntry::LT | Dependence::DVEntry::GT))
+        Carried.push_back({I, J});
+    }
+  }
+  for (unsigned K = 0; K < N; ++K) {
+    for (unsigned I = 0; I < N; ++I) {
+      if (Reaches[I][K])
+        Reaches[I] |= Reaches[K];
+    }
+  }
+
+  // Components are numbered in the program order of their first statement.
+  SmallVector<unsigned, 16> ComponentOf(N);
+  unsigned Components = 0;
+  for (unsigned I = 0; I < N; ++I) {
+    ComponentOf[I] = Components;
+    for (unsigned J = 0; J < I; ++J) {
+      if (Reaches[I][J] && Reaches[J][I]) {
+        ComponentOf[I] = ComponentOf[J];
+        break;
+      }
+    }
+    Components += ComponentOf[I] == Components;
+  }
+  if (Components < 2)
+    return {};
+
+  SmallVector<Partition, 8> Parts(Components);
+  for (unsigned I = 0; I < N; ++I) {
+    auto &Part = Parts[ComponentOf[I]];
+    Part.Statements.push_back(Statements[I]);
+    Part.Slice.insert(Slices[I].begin(), Slices[I].end());
+  }
+  BitVector Cyclic(Components);
+  for (auto [I, J] : Carried) {
+    if (ComponentOf[I] == ComponentOf[J])
+      Cyclic.set(ComponentOf[I]);
+  }
+  for (unsigned C = 0; C < Components; ++C) {
+    auto &Part = Parts[C];
+    Part.Vectorizable = !Cyclic[C];
+    for (auto &PHI : L->getHeader()->phis()) {
+      InductionDescriptor Induction;
+      RecurrenceDescriptor Reduction;
+      if (Part.Slice.count(&PHI) &&
+          !InductionDescriptor::isInductionPHI(&PHI, L, &SE, Induction) &&
+          !RecurrenceDescriptor::isReductionPHI(&PHI, L, Reduction))
+        Part.Vectorizable = false;
+    }
+  }
+
+  // A component is ready once all those it depends on are placed; the ones
+  // with values used after the loop wait for the others.
+  auto dependsOn = [&](unsigned C, unsigned D) {
+    for (unsigned I = 0; I < N; ++I) {
+      for (unsigned J = 0; J < N; ++J) {
+        if (ComponentOf[I] == D && ComponentOf[J] == C && Reaches[I][J])
+          return true;
+      }
+    }
+    return false;
+  };
+  auto hasLiveOuts = [&](unsigned C) {
+    return any_of(Parts[C].Statements,
+                  [&](Instruction *S) { return LiveOuts.count(S); });
+  };
+  SmallVector<unsigned, 8> Order;
+  BitVector Placed(Components);
+  while (Order.size() < Components) {
+    std::optional<unsigned> Next;
+    for (unsigned C = 0; C < Components; ++C) {
+      bool Ready = !Placed[C];
+      for (unsigned D = 0; D < Components && Ready; ++D)
+        Ready = Placed[D] || D == C || !dependsOn(C, D);
+      if (Ready && (!Next || (hasLiveOuts(*Next) && !hasLiveOuts(C))))
+        Next = C;
+    }
+    Placed.set(*Next);
+    Order.push_back(*Next);
+  }
+
+  SmallVector<Partition, 4> Partitions;
+  for (unsigned C : Order) {
+    auto &Part = Parts[C];
+    if (Partitions.empty() ||
+        Partitions.back().Vectorizable != Part.Vectorizable) {
+      Partitions.push_back(std::move(Part));
+      continue;
+    }
+    auto &Last = Partitions.back();
+    Last.Statements.append(Part.Statements.begin(), Part.Statements.end());
+    Last.Slice.insert(Part.Slice.begin(), Part.Slice.end());
+  }
+  for (unsigned K = 0; K + 1 < Partitions.size(); ++K) {
+    if (any_of(Partitions[K].Statements,
+               [&](Instruction *S) { return LiveOuts.count(S); }))
+      return {};
+  }
+  for (auto &Part : Partitions)
+    Part.Slice.insert(ControlSlice.begin(), ControlSlice.end());
+  return Partitions;
+}
+
+// Deletes from a copy of the loop, or from the loop itself when there is no
+// map, the instructions that the partition does not need.
+void LoopDistributionPass::removeOtherInstructions(
+    const Loop *L, const Partition &Part, ValueToValueMapTy *VMap) const {
+  SmallVector<Instruction *, 16> Unused;
+  for (auto *BB : L->getBlocks()) {
+    for (auto &I : *BB) {
+      if (!Part.Slice.count(&I))
+        Unused.push_back(VMap ? cast<Instruction>((*VMap)[&I]) : &I);
+    }
+  }
+  for (auto *I : reverse(Unused)) {
+    I->replaceAllUsesWith(PoisonValue::get(I->getType()));
+    I->eraseFromParent();
+  }
+}
+
+// Each partition but the last runs in a copy of the loop placed in front of
+// it, in order, while the last one stays in the original loop so that the
+// values used after the loop keep coming from it.
+void LoopDistributionPass::distribute(Loop *L, ArrayRef<Partition> Partitions,
+                                      Function &F,
+                                      FunctionAnalysisManager &FAM,
+                                      LoopDependenceIndex &Index) const {
+  auto &LI = FAM.getResult<LoopAnalysis>(F);
+  auto &DT = FAM.getResult<DominatorTreeAnalysis>(F);
+  auto &SE = FAM.getResult<ScalarEvolutionAnalysis>(F);
+
+  // The preheader is cloned with each copy, so it must be empty.
+  auto *Entry = L->getLoopPreheader();
+  auto *Preheader = SplitBlock(Entry, Entry->getTerminator(), &DT, &LI);
+  auto *Exit = L->getExitBlock();
+  Index.forgetLoop(L);
+
+  auto *TopPreheader = Preheader;
+  for (unsigned K = Partitions.size() - 1; K-- > 0;) {
+    ValueToValueMapTy VMap;
+    SmallVector<BasicBlock *, 8> Blocks;
+    auto *Copy = cloneLoopWithPreheader(TopPreheader, Entry, L, VMap,
+                                        ".dist" + Twine(K), &LI, &DT, Blocks);
+    VMap[Exit] = TopPreheader;
+    remapInstructionsInBlocks(Blocks, VMap);
+    removeOtherInstructions(L, Partitions[K], &VMap);
+    TopPreheader = Copy->getLoopPreheader();
+  }
+  Entry->getTerminator()->replaceUsesOfWith(Preheader, TopPreheader);
+  removeOtherInstructions(L, Partitions.back(), nullptr);
+
+  DT.recalculate(F);
+  FAM.getResult<PostDominatorTreeAnalysis>(F).recalculate(F);
+  SE.forgetLoop(L);
+}
+
+PreservedAnalyses LoopDistributionPass::run(Function &F,
+                                            FunctionAnalysisManager &FAM) {
+  auto &LI = FAM.getResult<LoopAnalysis>(F);
+  auto &DT = FAM.getResult<DominatorTreeAnalysis>(F);
+  LoopDependenceIndex Index(FAM.getResult<DependenceAnalysis>(F),
+                            FAM.getResult<AAManager>(F));
+
+  // A distributed loop is not distributed again, nor are its copies.
+  bool hasBeenOptimized = false;
+  for (auto *L : LI.getLoopsInPreorder()) {
+    if (!canDistribute(L, DT))
+      continue;
+    auto Partitions = partitionLoop(L, F, FAM, Index);
+    if (Partitions.size() > 1) {
+      distribute(L, Partitions, F, FAM, Index);
+      hasBeenOptimized = true;
+    }
+  }
+  return hasBeenOptimized ? PreservedAnalyses::none()
+                          : PreservedAnalyses::all();
+}
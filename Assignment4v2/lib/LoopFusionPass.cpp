@@ -2,35 +2,400 @@
 
 using namespace llvm;
 
-BasicBlock *LoopFusionPass::getLoopHead(const Loop *L) const {
-  return L->isGuarded() ? L->getLoopGuardBranch()->getParent()
-                        : L->getLoopPreheader();
+static cl::opt<unsigned> FusionMaxPeelCount(
+    "custom-loop-fusion-max-peel", cl::init(8), cl::Hidden,
+    cl::desc("Iterations that may be peeled off the longer of two loops to "
+             "match the trip count of the other one"));
+
+static cl::opt<unsigned> FusionCacheSize(
+    "custom-loop-fusion-cache-size", cl::init(0), cl::Hidden,
+    cl::desc("Bytes of the cache that fused loops should reuse data from "
+             "(0 asks the target for its L1 data cache)"));
+
+static cl::opt<unsigned> FusionCacheLineSize(
+    "custom-loop-fusion-cache-line-size", cl::init(0), cl::Hidden,
+    cl::desc("Bytes of a cache line (0 asks the target)"));
+
+// Loops are fused in a single shape: simplified and in LCSSA form, with the
+// exit test in a header that only computes it, and a latch that only jumps
+// back, reached from the last block of the body.
+bool LoopFusionPass::isInFusionForm(const Loop *L, DominatorTree &DT) const {
+  auto *Latch = L->getLoopLatch();
+  if (!L->isLoopSimplifyForm() || !L->isLCSSAForm(DT) || !L->getExitBlock() ||
+      !testsExitInHeader(L) || Latch == L->getHeader() ||
+      !Latch->getSinglePredecessor() || &Latch->front() != Latch->getTerminator())
+    return false;
+  auto *LatchBranch = dyn_cast<BranchInst>(Latch->getTerminator());
+  return LatchBranch && LatchBranch->isUnconditional();
 }
 
-BasicBlock *LoopFusionPass::getLoopExit(const Loop *L) const {
-  if (L->isGuarded()) {
-    if (auto *B = L->getLoopGuardBranch()) {
-      if (B->isConditional()) {
-        for (unsigned i = 0; i < B->getNumSuccessors(); ++i) {
-          if (!L->contains(B->getSuccessor(i)))
-            return B->getSuccessor(i);
-        }
-      }
+bool LoopFusionPass::testsExitInHeader(const Loop *L) const {
+  auto *Header = L->getHeader();
+  if (L->getExitingBlock() != Header)
+    return false;
+  for (auto &I : *Header) {
+    if (isa<PHINode>(I))
+      continue;
+    for (auto *U : I.users()) {
+      if (cast<Instruction>(U)->getParent() != Header)
+        return false;
     }
-  } else {
-    return L->getExitBlock();
   }
-  return nullptr;
+  auto *HeaderBranch = dyn_cast<BranchInst>(Header->getTerminator());
+  return HeaderBranch && HeaderBranch->isConditional();
+}
+
+// Whether canonicalizeLoops brings the loop into fusion form, judged without
+// changing it. Simplification, LCSSA and a dedicated latch can always be
+// had; the exit test must already be in the header, or the loop must be
+// rotated in a way unrotateLoop undoes.
+bool LoopFusionPass::canCanonicalize(const Loop *L, DominatorTree &DT,
+                                     ScalarEvolution &SE,
+                                     const DataLayout &DL) const {
+  if (isInFusionForm(L, DT))
+    return true;
+  if (L->isRotatedForm()) {
+    const SCEV *End;
+    return getUnrotationIV(L, SE, DL, End);
+  }
+  return testsExitInHeader(L);
+}
+
+// A rotated loop tests its exit in the latch. The header tests instead
+// whether an induction variable has reached the value it takes after the last
+// iteration, which SCEV derives from the latch test; the trip count must be
+// small enough for the variable not to reach it earlier by wrapping around.
+// The first test must be known to pass: the loop is entered under a guard that
+// implies it, or it holds outright. The values used after the loop are then
+// those of the previous iteration, kept in header phis.
+//
+// Returns the induction variable the header tests and, in End, the value it
+// is tested against, or nullptr if the loop cannot be unrotated.
+PHINode *LoopFusionPass::getUnrotationIV(const Loop *L, ScalarEvolution &SE,
+                                         const DataLayout &DL,
+                                         const SCEV *&End) const {
+  // The loop need not be simplified yet: its preheader will be split off the
+  // block it is entered from.
+  auto *Latch = L->getLoopLatch();
+  auto *Predecessor = L->getLoopPredecessor();
+  if (!Latch || !Predecessor || !L->getExitBlock() ||
+      L->getExitingBlock() != Latch)
+    return nullptr;
+  auto *LatchBranch = dyn_cast<BranchInst>(Latch->getTerminator());
+  auto *BackedgeTakenCount = SE.getBackedgeTakenCount(L);
+  if (!LatchBranch || !LatchBranch->isConditional() ||
+      isa<SCEVCouldNotCompute>(BackedgeTakenCount))
+    return nullptr;
+
+  auto *TripCount = SE.getAddExpr(BackedgeTakenCount,
+                                  SE.getOne(BackedgeTakenCount->getType()));
+  unsigned Width = SE.getTypeSizeInBits(TripCount->getType());
+  PHINode *IV = nullptr;
+  const SCEVConstant *Step = nullptr;
+  for (auto &PHI : L->getHeader()->phis()) {
+    auto *AddRec = dyn_cast<SCEVAddRecExpr>(SE.getSCEV(&PHI));
+    if (!AddRec || AddRec->getLoop() != L || !AddRec->isAffine() ||
+        PHI.getType() != TripCount->getType())
+      continue;
+    auto *Constant = dyn_cast<SCEVConstant>(AddRec->getStepRecurrence(SE));
+    if (!Constant || Constant->getAPInt().isZero())
+      continue;
+    unsigned Zeros = Constant->getAPInt().countTrailingZeros();
+    if (!Zeros || SE.isKnownPredicate(
+                      ICmpInst::ICMP_ULT, TripCount,
+                      SE.getConstant(APInt::getOneBitSet(Width, Width - Zeros)))) {
+      IV = &PHI;
+      Step = Constant;
+      break;
+    }
+  }
+  if (!IV)
+    return nullptr;
+
+  End = SE.getAddExpr(SE.getSCEV(IV->getIncomingValueForBlock(Predecessor)),
+                      SE.getMulExpr(TripCount, Step));
+  auto *Zero = SE.getZero(TripCount->getType());
+  SCEVExpander Expander(SE, DL, "fusion");
+  if (!Expander.isSafeToExpand(End) ||
+      (!SE.isKnownPredicate(ICmpInst::ICMP_NE, TripCount, Zero) &&
+       !SE.isLoopEntryGuardedByCond(L, ICmpInst::ICMP_NE, TripCount, Zero)))
+    return nullptr;
+  return IV;
+}
+
+bool LoopFusionPass::unrotateLoop(Loop *L, Function &F,
+                                  FunctionAnalysisManager &FAM) const {
+  auto &LI = FAM.getResult<LoopAnalysis>(F);
+  auto &DT = FAM.getResult<DominatorTreeAnalysis>(F);
+  auto &SE = FAM.getResult<ScalarEvolutionAnalysis>(F);
+  const auto &DL = F.getParent()->getDataLayout();
+
+  const SCEV *End;
+  auto *IV = getUnrotationIV(L, SE, DL, End);
+  if (!IV)
+    return false;
+
+  auto *Header = L->getHeader();
+  auto *Latch = L->getLoopLatch();
+  auto *Preheader = L->getLoopPreheader();
+  auto *Exit = L->getExitBlock();
+  auto *LatchBranch = cast<BranchInst>(Latch->getTerminator());
+  SCEVExpander Expander(SE, DL, "fusion");
+  auto *Body = SplitBlock(Header, Header->getFirstNonPHI(), &DT, &LI, nullptr,
+                          Header->getName() + ".body");
+  if (Latch == Header)
+    Latch = Body;
+
+  for (auto &PHI : Exit->phis()) {
+    auto *Incoming = PHI.getIncomingValueForBlock(Latch);
+    if (!L->isLoopInvariant(Incoming)) {
+      auto *Prev = PHINode::Create(Incoming->getType(), 2,
+                                   Incoming->getName() + ".prev",
+                                   Header->getFirstNonPHI());
+      Prev->addIncoming(PoisonValue::get(Incoming->getType()), Preheader);
+      Prev->addIncoming(Incoming, Latch);
+      PHI.setIncomingValueForBlock(Latch, Prev);
+    }
+    PHI.replaceIncomingBlockWith(Latch, Header);
+  }
+
+  auto *EndValue =
+      Expander.expandCodeFor(End, IV->getType(), Preheader->getTerminator());
+  auto *Cond = new ICmpInst(Header->getTerminator(), ICmpInst::ICMP_NE, IV,
+                            EndValue, "exitcond");
+  BranchInst::Create(Body, Exit, Cond, Header->getTerminator());
+  Header->getTerminator()->eraseFromParent();
+  auto *LatchCond = dyn_cast<Instruction>(LatchBranch->getCondition());
+  BranchInst::Create(Header, LatchBranch);
+  LatchBranch->eraseFromParent();
+  if (LatchCond && LatchCond->use_empty())
+    LatchCond->eraseFromParent();
+
+  DT.recalculate(F);
+  SE.forgetLoop(L);
+  return true;
+}
+
+// Two loops entered under the same condition are often guarded each, the
+// second guard sitting where the first one skips to. On the path through the
+// first loop the second guard is always taken, so the first guard can skip
+// both loops and the second one goes away, leaving the loops adjacent.
+bool LoopFusionPass::mergeGuards(const Loop *Lprev, const Loop *Lnext,
+                                 Function &F,
+                                 FunctionAnalysisManager &FAM) const {
+  auto &DT = FAM.getResult<DominatorTreeAnalysis>(F);
+  auto &SE = FAM.getResult<ScalarEvolutionAnalysis>(F);
+
+  auto isSameCondition = [&](Value *A, Value *B) {
+    auto *CmpA = dyn_cast<ICmpInst>(A);
+    auto *CmpB = dyn_cast<ICmpInst>(B);
+    return A == B ||
+           (CmpA && CmpB && CmpA->getPredicate() == CmpB->getPredicate() &&
+            SE.getSCEV(CmpA->getOperand(0)) == SE.getSCEV(CmpB->getOperand(0)) &&
+            SE.getSCEV(CmpA->getOperand(1)) == SE.getSCEV(CmpB->getOperand(1)));
+  };
+
+  auto *Guard = Lnext->getLoopPreheader()->getSinglePredecessor();
+  auto *GuardBranch =
+      Guard ? dyn_cast<BranchInst>(Guard->getTerminator()) : nullptr;
+  if (!GuardBranch || !GuardBranch->isConditional() ||
+      !Guard->hasNPredecessorsOrMore(2))
+    return false;
+  unsigned Taken =
+      GuardBranch->getSuccessor(0) == Lnext->getLoopPreheader() ? 0 : 1;
+  auto *Skip = GuardBranch->getSuccessor(1 - Taken);
+  for (auto &I : *Guard) {
+    if (!isa<PHINode>(I) && &I != GuardBranch &&
+        !(&I == GuardBranch->getCondition() && I.hasOneUse()))
+      return false;
+  }
+
+  for (auto *Node = DT.getNode(Lprev->getLoopPreheader())->getIDom(); Node;
+       Node = Node->getIDom()) {
+    auto *First = Node->getBlock();
+    auto *FirstBranch = dyn_cast<BranchInst>(First->getTerminator());
+    if (!FirstBranch || !FirstBranch->isConditional() ||
+        FirstBranch->getSuccessor(1 - Taken) != Guard ||
+        !DT.dominates(FirstBranch->getSuccessor(Taken),
+                      Lprev->getLoopPreheader()) ||
+        !isSameCondition(FirstBranch->getCondition(),
+                         GuardBranch->getCondition()))
+      continue;
+
+    // The second guard goes away, so every other way into it must come out
+    // of the first loop: a path skipping the first guard would otherwise run
+    // the second loop unconditionally.
+    auto *Entered = FirstBranch->getSuccessor(Taken);
+    if (!DT.dominates(First, Guard) ||
+        llvm::any_of(predecessors(Guard), [&](BasicBlock *Pred) {
+          return Pred != First && !DT.dominates(Entered, Pred);
+        }))
+      return false;
+
+    // The values the second guard passes on when skipping, as seen from the
+    // first one.
+    SmallVector<Value *, 4> Skipped;
+    for (auto &PHI : Skip->phis()) {
+      auto *Incoming = PHI.getIncomingValueForBlock(Guard);
+      auto *I = dyn_cast<Instruction>(Incoming);
+      if (I && I->getParent() == Guard && isa<PHINode>(I))
+        Incoming = cast<PHINode>(I)->getIncomingValueForBlock(First);
+      else if (I && !DT.dominates(I, FirstBranch))
+        return false;
+      Skipped.push_back(Incoming);
+    }
+
+    unsigned K = 0;
+    for (auto &PHI : Skip->phis()) {
+      PHI.addIncoming(Skipped[K++], First);
+      PHI.removeIncomingValue(Guard);
+    }
+    for (auto &PHI : Guard->phis())
+      PHI.removeIncomingValue(First);
+    FirstBranch->setSuccessor(1 - Taken, Skip);
+
+    auto *Cond = dyn_cast<Instruction>(GuardBranch->getCondition());
+    BranchInst::Create(GuardBranch->getSuccessor(Taken), GuardBranch);
+    GuardBranch->eraseFromParent();
+    if (Cond && Cond->use_empty())
+      Cond->eraseFromParent();
+    return true;
+  }
+  return false;
+}
+
+// Brings the candidate loops into the form fusion works on, whatever shape the
+// front end and the earlier passes left them in.
+bool LoopFusionPass::canonicalizeLoops(ArrayRef<Loop *> Loops, Function &F,
+                                       FunctionAnalysisManager &FAM,
+                                       LoopDependenceIndex &Index) const {
+  auto &LI = FAM.getResult<LoopAnalysis>(F);
+  auto &DT = FAM.getResult<DominatorTreeAnalysis>(F);
+  auto &SE = FAM.getResult<ScalarEvolutionAnalysis>(F);
+  auto &AC = FAM.getResult<AssumptionAnalysis>(F);
+
+  bool Changed = false;
+  for (auto *L : Loops) {
+    Changed |= simplifyLoop(L, &DT, &LI, &SE, &AC, nullptr, false);
+    Changed |= formLCSSARecursively(*L, DT, &LI, &SE);
+    if (L->isRotatedForm())
+      Changed |= unrotateLoop(L, F, FAM);
+
+    auto *Latch = L->getLoopLatch();
+    if (L->getExitingBlock() == L->getHeader() && Latch != L->getHeader() &&
+        (!Latch->getSinglePredecessor() ||
+         &Latch->front() != Latch->getTerminator())) {
+      SplitBlock(Latch, Latch->getTerminator(), &DT, &LI, nullptr,
+                 Latch->getName() + ".latch");
+      Changed = true;
+    }
+    Index.forgetLoop(L);
+  }
+
+  for (unsigned K = 0; K + 1 < Loops.size(); ++K) {
+    if (isInFusionForm(Loops[K], DT) && isInFusionForm(Loops[K + 1], DT) &&
+        mergeGuards(Loops[K], Loops[K + 1], F, FAM)) {
+      DT.recalculate(F);
+      SE.forgetLoop(Loops[K + 1]);
+      Changed = true;
+    }
+  }
+
+  if (Changed) {
+    DT.recalculate(F);
+    FAM.getResult<PostDominatorTreeAnalysis>(F).recalculate(F);
+  }
+  return Changed;
+}
+
+// In fusion form, the code that enters a loop ends in its preheader and the
+// code that follows it starts in its exit block.
+BasicBlock *LoopFusionPass::getLoopHead(const Loop *L) const {
+  return L->getLoopPreheader();
+}
+
+BasicBlock *LoopFusionPass::getLoopExit(const Loop *L) const {
+  return L->getExitBlock();
 }
 
 bool LoopFusionPass::areLoopsAdjacent(const Loop *Lprev, const Loop *Lnext) const {
   return getLoopExit(Lprev) == getLoopHead(Lnext);
 }
 
+// Code between two loops keeps them apart. Each instruction is hoisted in
+// front of the first loop or, failing that, sunk after the second one, when
+// CodeMoverUtils finds that it does not depend on the code it moves across.
+// The blocks left empty are then folded into the exit of the first loop.
+bool LoopFusionPass::makeLoopsAdjacent(const Loop *Lprev, const Loop *Lnext,
+                                       Function &F,
+                                       FunctionAnalysisManager &FAM,
+                                       bool &Changed) {
+  auto *Exit = getLoopExit(Lprev);
+  auto *Head = getLoopHead(Lnext);
+  auto *NextExit = getLoopExit(Lnext);
+  if (!Exit || !Head || !NextExit)
+    return false;
+
+  // Only a straight line of blocks may separate the loops.
+  SmallVector<BasicBlock *, 4> Between{Exit};
+  while (Between.back() != Head) {
+    auto *Next = Between.back()->getSingleSuccessor();
+    if (!Next || Next->getSinglePredecessor() != Between.back())
+      return false;
+    Between.push_back(Next);
+  }
+
+  SmallVector<Instruction *, 8> Intervening;
+  for (auto *BB : Between) {
+    Changed |= FoldSingleEntryPHINodes(BB);
+    for (auto &I : *BB) {
+      if (!I.isTerminator() && !I.isDebugOrPseudoInst())
+        Intervening.push_back(&I);
+    }
+  }
+
+  auto &DT = FAM.getResult<DominatorTreeAnalysis>(F);
+  auto &PDT = FAM.getResult<PostDominatorTreeAnalysis>(F);
+  auto &DI = FAM.getResult<DependenceAnalysis>(F);
+
+  auto *HoistPoint = getLoopHead(Lprev)->getTerminator();
+  SmallVector<Instruction *, 8> ToSink;
+  for (auto *I : Intervening) {
+    if (isSafeToMoveBefore(*I, *HoistPoint, DT, &PDT, &DI)) {
+      I->moveBefore(HoistPoint);
+      Changed = true;
+    } else {
+      ToSink.push_back(I);
+    }
+  }
+
+  // Sinking in reverse order keeps every sunk instruction ahead of its users.
+  auto *SinkPoint = &*NextExit->getFirstInsertionPt();
+  for (auto *I : llvm::reverse(ToSink)) {
+    if (!isSafeToMoveBefore(*I, *SinkPoint, DT, &PDT, &DI))
+      return false;
+    I->moveBefore(SinkPoint);
+    SinkPoint = I;
+    Changed = true;
+  }
+
+  if (Between.size() > 1) {
+    auto &LI = FAM.getResult<LoopAnalysis>(F);
+    for (auto *BB : llvm::drop_begin(Between))
+      MergeBlockIntoPredecessor(BB, nullptr, &LI);
+    DT.recalculate(F);
+    PDT.recalculate(F);
+    Changed = true;
+  }
+  return areLoopsAdjacent(Lprev, Lnext);
+}
+
 bool LoopFusionPass::areLoopsCFE(const Loop *Lprev, const Loop *Lnext, Function &F,
                                  FunctionAnalysisManager &FAM) const {
   const auto *LprevHead = getLoopHead(Lprev);
   const auto *LnextHead = getLoopHead(Lnext);
+  if (!LprevHead || !LnextHead)
+    return false;
 
   auto &DT = FAM.getResult<DominatorTreeAnalysis>(F);
   auto &PDT = FAM.getResult<PostDominatorTreeAnalysis>(F);
@@ -38,40 +403,308 @@ bool LoopFusionPass::areLoopsCFE(const Loop *Lprev, const Loop *Lnext, Function
   return DT.dominates(LprevHead, LnextHead) && PDT.dominates(LnextHead, LprevHead);
 }
 
+// Values of the first loop reach the second one only through memory, which
+// the dependence index checks: once fused, the second loop would read them
+// before the first one is done. Before the loops are simplified, the exit of
+// the first loop may be the header of the second one.
+bool LoopFusionPass::usesLiveOuts(const Loop *Lprev, const Loop *Lnext) const {
+  for (auto *BB : Lnext->getBlocks()) {
+    for (auto &I : *BB) {
+      for (auto *Op : I.operand_values()) {
+        auto *OpInst = dyn_cast<Instruction>(Op);
+        if (OpInst && (Lprev->contains(OpInst) ||
+                       (OpInst->getParent() == Lprev->getExitBlock() &&
+                        !Lnext->contains(OpInst))))
+          return true;
+      }
+    }
+  }
+  return false;
+}
+
+// The backedge-taken counts of two loops, zero-extended to the wider of their
+// types since the induction variables are normalized when they are fused.
+// Those of rotated loops are counted as after unrotateLoop, which adds the
+// backedge taken by the last iteration.
+bool LoopFusionPass::getBackedgeTakenCounts(const Loop *Lprev,
+                                            const Loop *Lnext,
+                                            ScalarEvolution &SE,
+                                            const SCEV *&LprevTC,
+                                            const SCEV *&LnextTC) const {
+  auto getCount = [&](const Loop *L) {
+    auto *Count = SE.getBackedgeTakenCount(L);
+    if (isa<SCEVCouldNotCompute>(Count) ||
+        L->getExitingBlock() != L->getLoopLatch())
+      return Count;
+    return SE.getAddExpr(Count, SE.getOne(Count->getType()));
+  };
+  LprevTC = getCount(Lprev);
+  LnextTC = getCount(Lnext);
+  if (isa<SCEVCouldNotCompute>(LprevTC) || isa<SCEVCouldNotCompute>(LnextTC)) {
+    return false;
+  }
+  auto *Ty = SE.getWiderType(LprevTC->getType(), LnextTC->getType());
+  LprevTC = SE.getNoopOrZeroExtend(LprevTC, Ty);
+  LnextTC = SE.getNoopOrZeroExtend(LnextTC, Ty);
+  return true;
+}
+
 bool LoopFusionPass::areLoopsTCE(const Loop *Lprev, const Loop *Lnext, Function &F,
                                  FunctionAnalysisManager &FAM) const {
   auto &SE = FAM.getResult<ScalarEvolutionAnalysis>(F);
-  auto LprevTC = SE.getBackedgeTakenCount(Lprev);
-  auto LnextTC = SE.getBackedgeTakenCount(Lnext);
-
-  if (isa<SCEVCouldNotCompute>(LprevTC) || isa<SCEVCouldNotCompute>(LnextTC)) {
+  const SCEV *LprevTC, *LnextTC;
+  if (!getBackedgeTakenCounts(Lprev, Lnext, SE, LprevTC, LnextTC)) {
     return false;
   }
   return SE.isKnownPredicate(CmpInst::ICMP_EQ, LprevTC, LnextTC);
 }
 
-bool LoopFusionPass::areLoopsIndependent(const Loop *Lprev, const Loop *Lnext, Function &F,
-                                         FunctionAnalysisManager &FAM) const {
-  auto &DI = FAM.getResult<DependenceAnalysis>(F);
+// Loops whose trip counts differ by a small constant can still be fused once
+// the excess iterations are peeled off the longer one: off the front of the
+// first loop, so that the copies run before the fused loop, or off the back
+// of the second one, so that they run after it.
+bool LoopFusionPass::getPeelCount(const Loop *Lprev, const Loop *Lnext,
+                                  Function &F, FunctionAnalysisManager &FAM,
+                                  int &PeelCount) const {
+  PeelCount = 0;
+  if (areLoopsTCE(Lprev, Lnext, F, FAM))
+    return true;
+
+  auto &SE = FAM.getResult<ScalarEvolutionAnalysis>(F);
+  const SCEV *LprevTC, *LnextTC;
+  if (!getBackedgeTakenCounts(Lprev, Lnext, SE, LprevTC, LnextTC)) {
+    return false;
+  }
+
+  auto *Difference =
+      dyn_cast<SCEVConstant>(SE.getMinusSCEV(LprevTC, LnextTC));
+  if (!Difference)
+    return false;
+  const APInt &Excess = Difference->getAPInt();
+  if (Excess.abs().ugt(FusionMaxPeelCount))
+    return false;
 
-  for (auto *BB : Lprev->getBlocks()) {
+  // The peeled loop must run at least the peeled iterations, so that their
+  // exits are never taken: its count must not be the other one's wrapped.
+  if (!Excess.isNegative()) {
+    if (!SE.isKnownPredicate(CmpInst::ICMP_UGE, LprevTC, Difference) ||
+        !canPeelFirstIterations(Lprev))
+      return false;
+    PeelCount = Excess.getZExtValue();
+    return true;
+  }
+  if (!SE.isKnownPredicate(CmpInst::ICMP_UGE, LnextTC,
+                           SE.getNegativeSCEV(Difference)) ||
+      !canPeelLastIterations(Lnext))
+    return false;
+  PeelCount = -static_cast<int>(Excess.abs().getZExtValue());
+  return true;
+}
+
+// LLVM's peeling wants rotated loops, whose latch is the exiting block; the
+// loops fused here test their condition in the header. They are simplified
+// by the time they are peeled, as every loop that is fused is.
+bool LoopFusionPass::canPeelFirstIterations(const Loop *L) const {
+  if (!L->isInnermost() || !L->getExitingBlock())
+    return false;
+  for (auto *BB : L->getBlocks()) {
+    if (!isa<BranchInst>(BB->getTerminator()))
+      return false;
     for (auto &I : *BB) {
-      if (isa<LoadInst>(&I) || isa<StoreInst>(&I)) {
-        for (auto *BB2 : Lnext->getBlocks()) {
-          for (auto &I2 : *BB2) {
-            if (isa<LoadInst>(&I2) || isa<StoreInst>(&I2)) {
-              if (DI.depends(&I, &I2, true)) {
-                return false;
-              }
-            }
-          }
-        }
+      if (auto *Call = dyn_cast<CallBase>(&I)) {
+        if (Call->cannotDuplicate())
+          return false;
       }
     }
   }
   return true;
 }
 
+// The copies of the last iterations are placed on the exit edge, where only
+// the header phis of the loop are known: in fusion form the header is the
+// exiting block, so every value used after the loop must be one of them. A
+// rotated loop is checked again once unrotateLoop has made them so.
+bool LoopFusionPass::canPeelLastIterations(const Loop *L) const {
+  if (!canPeelFirstIterations(L))
+    return false;
+  if (L->isRotatedForm())
+    return true;
+  for (auto &PHI : L->getExitBlock()->phis()) {
+    auto *Incoming = dyn_cast<Instruction>(PHI.getIncomingValue(0));
+    if (Incoming && L->contains(Incoming) &&
+        !(isa<PHINode>(Incoming) && Incoming->getParent() == L->getHeader()))
+      return false;
+  }
+  return true;
+}
+
+// Each peeled iteration is a copy of the loop blocks in which the header phis
+// are replaced by the values of the previous iteration. The copies never
+// leave through the exit (see getPeelCount) and the last one becomes the new
+// preheader of the loop.
+void LoopFusionPass::peelFirstIterations(Loop *L, unsigned PeelCount,
+                                         Function &F,
+                                         FunctionAnalysisManager &FAM,
+                                         LoopDependenceIndex &Index) {
+  auto &LI = FAM.getResult<LoopAnalysis>(F);
+  auto &SE = FAM.getResult<ScalarEvolutionAnalysis>(F);
+
+  auto *Header = L->getHeader();
+  auto *Latch = L->getLoopLatch();
+  auto *Exiting = L->getExitingBlock();
+  auto *Exit = L->getExitBlock();
+  auto *Preheader = L->getLoopPreheader();
+
+  Index.forgetLoop(L);
+
+  DenseMap<PHINode *, Value *> Current;
+  for (auto &PHI : Header->phis())
+    Current[&PHI] = PHI.getIncomingValueForBlock(Preheader);
+
+  BasicBlock *Entry = Preheader;
+  BasicBlock *EntryTarget = Header;
+  for (unsigned Iteration = 0; Iteration < PeelCount; ++Iteration) {
+    ValueToValueMapTy VMap;
+    SmallVector<BasicBlock *, 8> NewBlocks;
+    for (auto *BB : L->getBlocks()) {
+      auto *NewBB = CloneBasicBlock(BB, VMap, ".peel", &F);
+      NewBB->moveBefore(Header);
+      VMap[BB] = NewBB;
+      NewBlocks.push_back(NewBB);
+      if (auto *Parent = L->getParentLoop())
+        Parent->addBasicBlockToLoop(NewBB, LI);
+    }
+    for (auto [PHI, Incoming] : Current) {
+      cast<PHINode>(VMap[PHI])->eraseFromParent();
+      VMap[PHI] = Incoming;
+    }
+    remapInstructionsInBlocks(NewBlocks, VMap);
+
+    auto *ExitBranch = cast<BranchInst>(VMap[Exiting->getTerminator()]);
+    BranchInst::Create(ExitBranch->getSuccessor(
+                           ExitBranch->getSuccessor(0) == Exit ? 1 : 0),
+                       ExitBranch);
+    ExitBranch->eraseFromParent();
+
+    auto *NewHeader = cast<BasicBlock>(VMap[Header]);
+    Entry->getTerminator()->replaceSuccessorWith(EntryTarget, NewHeader);
+    Entry = cast<BasicBlock>(VMap[Latch]);
+    EntryTarget = NewHeader;
+
+    for (auto &[PHI, Incoming] : Current) {
+      auto *Next = PHI->getIncomingValueForBlock(Latch);
+      if (auto Mapped = VMap.lookup(Next))
+        Incoming = Mapped;
+      else
+        Incoming = Next;
+    }
+  }
+
+  Entry->getTerminator()->replaceSuccessorWith(EntryTarget, Header);
+  for (auto [PHI, Incoming] : Current) {
+    PHI->setIncomingValueForBlock(Preheader, Incoming);
+    PHI->replaceIncomingBlockWith(Preheader, Entry);
+  }
+
+  FAM.getResult<DominatorTreeAnalysis>(F).recalculate(F);
+  FAM.getResult<PostDominatorTreeAnalysis>(F).recalculate(F);
+  SE.forgetLoop(L);
+}
+
+// The last iterations are copied the same way onto the exit edge, starting
+// from the values the header phis have when the loop exits. Until the loop is
+// merged into the shorter one before it, the copies run after all of its own
+// iterations: merge drops the exit test of L for the one of the first loop,
+// which leaves exactly the peeled iterations to the copies.
+void LoopFusionPass::peelLastIterations(Loop *L, unsigned PeelCount,
+                                        Function &F,
+                                        FunctionAnalysisManager &FAM,
+                                        LoopDependenceIndex &Index) {
+  auto &LI = FAM.getResult<LoopAnalysis>(F);
+  auto &SE = FAM.getResult<ScalarEvolutionAnalysis>(F);
+
+  auto *Header = L->getHeader();
+  auto *Latch = L->getLoopLatch();
+  auto *Exit = L->getExitBlock();
+  auto *Parent = L->getParentLoop();
+
+  Index.forgetLoop(L);
+
+  // A dedicated block on the exit edge holds the header phis in LCSSA form.
+  auto *Landing = BasicBlock::Create(F.getContext(),
+                                     Header->getName() + ".epilogue", &F, Exit);
+  Header->getTerminator()->replaceSuccessorWith(Exit, Landing);
+  BranchInst::Create(Exit, Landing);
+  Exit->replacePhiUsesWith(Header, Landing);
+  if (Parent)
+    Parent->addBasicBlockToLoop(Landing, LI);
+
+  DenseMap<PHINode *, Value *> Current;
+  for (auto &PHI : Header->phis()) {
+    auto *LCSSA = PHINode::Create(PHI.getType(), 1, PHI.getName() + ".lcssa",
+                                  &Landing->front());
+    LCSSA->addIncoming(&PHI, Header);
+    Current[&PHI] = LCSSA;
+  }
+
+  BasicBlock *Entry = Landing;
+  BasicBlock *EntryTarget = Exit;
+  for (unsigned Iteration = 0; Iteration < PeelCount; ++Iteration) {
+    ValueToValueMapTy VMap;
+    SmallVector<BasicBlock *, 8> NewBlocks;
+    for (auto *BB : L->getBlocks()) {
+      auto *NewBB = CloneBasicBlock(BB, VMap, ".peel", &F);
+      NewBB->moveBefore(Exit);
+      VMap[BB] = NewBB;
+      NewBlocks.push_back(NewBB);
+      if (Parent)
+        Parent->addBasicBlockToLoop(NewBB, LI);
+    }
+    for (auto [PHI, Incoming] : Current) {
+      cast<PHINode>(VMap[PHI])->eraseFromParent();
+      VMap[PHI] = Incoming;
+    }
+    remapInstructionsInBlocks(NewBlocks, VMap);
+
+    auto *ExitBranch = cast<BranchInst>(VMap[Header->getTerminator()]);
+    BranchInst::Create(ExitBranch->getSuccessor(
+                           ExitBranch->getSuccessor(0) == Landing ? 1 : 0),
+                       ExitBranch);
+    ExitBranch->eraseFromParent();
+
+    auto *NewHeader = cast<BasicBlock>(VMap[Header]);
+    Entry->getTerminator()->replaceSuccessorWith(EntryTarget, NewHeader);
+    Entry = cast<BasicBlock>(VMap[Latch]);
+    EntryTarget = NewHeader;
+
+    for (auto &[PHI, Incoming] : Current) {
+      auto *Next = PHI->getIncomingValueForBlock(Latch);
+      if (auto Mapped = VMap.lookup(Next))
+        Incoming = Mapped;
+      else
+        Incoming = Next;
+    }
+  }
+
+  // The values the loop passed on when exiting are those after the copies.
+  Entry->getTerminator()->replaceSuccessorWith(EntryTarget, Exit);
+  for (auto &PHI : Exit->phis()) {
+    auto *Incoming = PHI.getIncomingValueForBlock(Landing);
+    if (auto *HeaderPHI = dyn_cast<PHINode>(Incoming);
+        HeaderPHI && Current.count(HeaderPHI))
+      PHI.setIncomingValueForBlock(Landing, Current[HeaderPHI]);
+    PHI.replaceIncomingBlockWith(Landing, Entry);
+  }
+  for (auto &PHI : llvm::make_early_inc_range(Landing->phis())) {
+    if (PHI.use_empty())
+      PHI.eraseFromParent();
+  }
+
+  FAM.getResult<DominatorTreeAnalysis>(F).recalculate(F);
+  FAM.getResult<PostDominatorTreeAnalysis>(F).recalculate(F);
+  SE.forgetLoop(L);
+}
+
 PHINode *LoopFusionPass::getIVForNonRotatedLoops(Loop *L, ScalarEvolution &SE) const {
   if (L->isCanonical(SE)) {
     return L->getCanonicalInductionVariable();
@@ -79,7 +712,7 @@ PHINode *LoopFusionPass::getIVForNonRotatedLoops(Loop *L, ScalarEvolution &SE) c
 
   for (auto &PHI : L->getHeader()->phis()) {
     if (auto *PHIasADDREC = dyn_cast<SCEVAddRecExpr>(SE.getSCEV(&PHI))) {
-      if (PHIasADDREC->getLoop() == L) {
+      if (PHIasADDREC->getLoop() == L && PHIasADDREC->isAffine()) {
         for (auto *U : PHI.users()) {
           if (auto *Cmp = dyn_cast<ICmpInst>(U)) {
             if (L->contains(Cmp)) {
@@ -93,8 +726,31 @@ PHINode *LoopFusionPass::getIVForNonRotatedLoops(Loop *L, ScalarEvolution &SE) c
   return nullptr;
 }
 
+// The induction variable of another loop as an affine recurrence of L, i.e.
+// the value it takes in the same iteration of L.
+const SCEVAddRecExpr *
+LoopFusionPass::getNormalizedIV(const Loop *L, PHINode *IV,
+                                ScalarEvolution &SE) const {
+  auto *AddRec = cast<SCEVAddRecExpr>(SE.getSCEV(IV));
+  return cast<SCEVAddRecExpr>(SE.getAddRecExpr(AddRec->getStart(),
+                                               AddRec->getStepRecurrence(SE),
+                                               L, SCEV::FlagAnyWrap));
+}
+
+// The start and step of the second induction variable are computed in the
+// fused loop, so they must be available in front of the first one.
+bool LoopFusionPass::canNormalizeIVs(Loop *Lprev, Loop *Lnext,
+                                     ScalarEvolution &SE) const {
+  auto *PIV = getIVForNonRotatedLoops(Lprev, SE);
+  auto *NIV = getIVForNonRotatedLoops(Lnext, SE);
+  return PIV && NIV &&
+         SE.properlyDominates(getNormalizedIV(Lprev, NIV, SE),
+                              Lprev->getHeader());
+}
+
 Loop *LoopFusionPass::merge(Loop *Lprev, Loop *Lnext, Function &F,
-                            FunctionAnalysisManager &FAM) {
+                            FunctionAnalysisManager &FAM,
+                            LoopDependenceIndex &Index) {
   auto &SE = FAM.getResult<ScalarEvolutionAnalysis>(F);
   auto &LI = FAM.getResult<LoopAnalysis>(F);
 
@@ -103,18 +759,35 @@ Loop *LoopFusionPass::merge(Loop *Lprev, Loop *Lnext, Function &F,
   auto *PH = Lprev->getHeader();
   auto *PPH = Lprev->getLoopPreheader();
   auto *PE = Lprev->getExitBlock();
-  auto *PG = Lprev->getLoopGuardBranch();
 
   auto *NL = Lnext->getLoopLatch();
   auto *NB = NL->getSinglePredecessor();
   auto *NH = Lnext->getHeader();
+  auto *NBEntry = NH->getTerminator()->getSuccessor(0);
+  if (!Lnext->contains(NBEntry))
+    NBEntry = NH->getTerminator()->getSuccessor(1);
   auto *NPH = Lnext->getLoopPreheader();
   auto *NE = Lnext->getExitBlock();
 
+  Index.forgetLoop(Lprev);
+  Index.forgetLoop(Lnext);
+
   auto PIV = getIVForNonRotatedLoops(Lprev, SE);
   auto NIV = getIVForNonRotatedLoops(Lnext, SE);
 
-  NIV->replaceAllUsesWith(PIV);
+  // The induction variables may differ in type, start and step, e.g. once
+  // the first loop has been peeled. The one of the second loop is rewritten
+  // as an affine function of the iteration count of the fused loop, which
+  // SCEVExpander materializes as a canonical 0-based unit-step counter.
+  Value *FusedIV = PIV;
+  auto *NextIV = getNormalizedIV(Lprev, NIV, SE);
+  if (NextIV != SE.getSCEV(PIV)) {
+    SCEVExpander Expander(SE, F.getParent()->getDataLayout(), "fusion");
+    FusedIV = Expander.expandCodeFor(NextIV, NIV->getType(),
+                                     PH->getFirstNonPHI());
+  }
+
+  NIV->replaceAllUsesWith(FusedIV);
   NIV->eraseFromParent();
 
   SmallVector<PHINode *, 8> PHIsToMove;
@@ -137,42 +810,346 @@ Loop *LoopFusionPass::merge(Loop *Lprev, Loop *Lnext, Function &F,
   }
 
   PH->getTerminator()->replaceSuccessorWith(PE, NE);
-  PB->getTerminator()->replaceSuccessorWith(PL, NB);
+  PB->getTerminator()->replaceSuccessorWith(PL, NBEntry);
   NB->getTerminator()->replaceSuccessorWith(NL, PL);
-  NH->getTerminator()->replaceSuccessorWith(NB, NL);
-  if (PG) {
-    PG->setSuccessor(1, NE);
+  NH->getTerminator()->eraseFromParent();
+  BranchInst::Create(NL, NH);
+  NE->replacePhiUsesWith(NH, PH);
+
+  // The body of the second loop, inner loops included, now belongs to the
+  // first one.
+  while (!Lnext->isInnermost())
+    Lprev->addChildLoop(Lnext->removeChildLoop(Lnext->begin()));
+  SmallVector<BasicBlock *, 8> Body;
+  for (auto *BB : Lnext->getBlocks()) {
+    if (BB != NH && BB != NL)
+      Body.push_back(BB);
+  }
+  for (auto *BB : Body) {
+    Lprev->addBlockEntry(BB);
+    Lnext->removeBlockFromLoop(BB);
+    if (LI.getLoopFor(BB) == Lnext)
+      LI.changeLoopFor(BB, Lprev);
   }
+  SE.forgetLoop(Lnext);
 
-  Lprev->addBasicBlockToLoop(NB, LI);
-  Lnext->removeBlockFromLoop(NB);
-  LI.erase(Lnext);
-  EliminateUnreachableBlocks(F);
+  // What is left of the second loop, and the block that separated the two
+  // loops, is now unreachable. The blocks leave the enclosing loops before
+  // they are deleted, so that no loop keeps pointers to them.
+  SmallVector<BasicBlock *, 3> DeadBlocks{PE, NH, NL};
+  for (auto *BB : DeadBlocks)
+    LI.removeBlock(BB);
+  if (auto *Parent = Lnext->getParentLoop())
+    Parent->removeChildLoop(Lnext);
+  else
+    LI.removeLoop(llvm::find(LI, Lnext));
+  LI.destroy(Lnext);
+  DeleteDeadBlocks(DeadBlocks);
 
+  SE.forgetLoop(Lprev);
+  FAM.getResult<DominatorTreeAnalysis>(F).recalculate(F);
+  FAM.getResult<PostDominatorTreeAnalysis>(F).recalculate(F);
   return Lprev;
 }
 
-PreservedAnalyses LoopFusionPass::run(Function &F,
-                                      FunctionAnalysisManager &FAM) {
+// Values the loop keeps in registers: its header phis and the values defined
+// outside of it that its instructions use.
+void LoopFusionPass::getLiveValues(
+    const Loop *L, SmallPtrSetImpl<const Value *> &LiveValues) const {
+  for (auto &PHI : L->getHeader()->phis())
+    LiveValues.insert(&PHI);
+  for (auto *BB : L->getBlocks()) {
+    for (auto &I : *BB) {
+      for (auto *Op : I.operand_values()) {
+        auto *OpInst = dyn_cast<Instruction>(Op);
+        if (isa<Argument>(Op) || (OpInst && !L->contains(OpInst)))
+          LiveValues.insert(Op);
+      }
+    }
+  }
+}
+
+// A cheap guess of what the loop vectorizer accepts: an innermost loop with a
+// preheader, a single latch and a single exit, no calls other than intrinsics
+// and only inductions and reductions in its header. Returns the size of the
+// loop body, or 0.
+unsigned LoopFusionPass::getVectorizableSize(Loop *L,
+                                             ScalarEvolution &SE) const {
+  if (!L->isInnermost() || !L->getLoopPreheader() || !L->getLoopLatch() ||
+      !L->getExitingBlock())
+    return 0;
+  for (auto &PHI : L->getHeader()->phis()) {
+    InductionDescriptor Induction;
+    RecurrenceDescriptor Reduction;
+    if (!InductionDescriptor::isInductionPHI(&PHI, L, &SE, Induction) &&
+        !RecurrenceDescriptor::isReductionPHI(&PHI, L, Reduction))
+      return 0;
+  }
+  unsigned Size = 0;
+  for (auto *BB : L->getBlocks()) {
+    for (auto &I : *BB) {
+      if (isa<CallBase>(&I) && !isa<IntrinsicInst>(&I))
+        return 0;
+      Size += !I.isDebugOrPseudoInst();
+    }
+  }
+  return Size;
+}
+
+// The bytes one iteration of the loop touches, each address counted once and
+// those of inner loops once per inner iteration, and the bytes of the whole
+// loop. A trip count that is not a known constant saturates the estimate.
+LoopFusionPass::LoopFootprint
+LoopFusionPass::getFootprint(const Loop *L, LoopInfo &LI, ScalarEvolution &SE,
+                             const DataLayout &DL) const {
+  auto getTripCount = [&](const Loop *M) -> uint64_t {
+    unsigned TripCount = SE.getSmallConstantTripCount(M);
+    return TripCount ? TripCount : std::numeric_limits<uint64_t>::max();
+  };
+
+  LoopFootprint Footprint;
+  SmallPtrSet<const SCEV *, 16> Addresses;
+  for (auto *BB : L->getBlocks()) {
+    for (auto &I : *BB) {
+      auto *Ptr = getLoadStorePointerOperand(&I);
+      if (!Ptr || !Addresses.insert(SE.getSCEV(Ptr)).second)
+        continue;
+      Footprint.Objects.insert(getUnderlyingObject(Ptr));
+      uint64_t Bytes = DL.getTypeStoreSize(getLoadStoreType(&I));
+      for (auto *M = LI.getLoopFor(BB); M != L; M = M->getParentLoop())
+        Bytes = SaturatingMultiply(Bytes, getTripCount(M));
+      Footprint.IterationBytes = SaturatingAdd(Footprint.IterationBytes, Bytes);
+    }
+  }
+  Footprint.Bytes = SaturatingMultiply(Footprint.IterationBytes, getTripCount(L));
+  return Footprint;
+}
+
+// Weights of the profitability estimate, in instructions per iteration: the
+// control of a loop that disappears, an array reread from the cache instead
+// of memory, and the share of a vectorizable body that is lost when it is
+// fused with a loop that cannot be vectorized.
+static constexpr int LoopControlBenefit = 2;
+static constexpr int CacheReuseBenefit = 4;
+static constexpr int VectorizationLossDivisor = 2;
+
+// The fusion graph has a node for each loop, in program order, and an edge
+// for each pair of loops that may legally be fused (peeling one of them if
+// needed). Since only loops that end up adjacent are fused, a partition of
+// the graph is a split of the sequence into runs of loops, and the one with
+// the largest benefit is found by dynamic programming on the end of the last
+// run. A run is legal when all of its pairs are edges, it fits the registers
+// of the target and only its first loop needs peeling, or the second one if
+// it is the last: the copies of its last iterations would otherwise stand
+// between the fused loop and the next one.
+//
+// A run is profitable when every loop after the first one reuses from the
+// cache an array that an earlier loop of the run accessed. Unfused, the data
+// touched between the two accesses is about a whole loop; fused, it is a
+// single iteration of the loops in between. The reuse improves when the
+// latter fits the cache and the former does not, and the run keeps a line of
+// each of its arrays resident.
+//
+// A tentative partition is taken before the loops are canonicalized: loops
+// only need to be brought into fusion form, and the guards that keep them
+// from being control-flow equivalent are left to mergeGuards.
+SmallVector<LoopFusionPass::FusionGroup, 4>
+LoopFusionPass::partitionLoops(ArrayRef<Loop *> Loops, Function &F,
+                               FunctionAnalysisManager &FAM,
+                               LoopDependenceIndex &Index,
+                               bool Tentative) const {
+  auto &SE = FAM.getResult<ScalarEvolutionAnalysis>(F);
   auto &LI = FAM.getResult<LoopAnalysis>(F);
+  auto &DT = FAM.getResult<DominatorTreeAnalysis>(F);
+  auto &TTI = FAM.getResult<TargetIRAnalysis>(F);
+  unsigned Registers =
+      TTI.getNumberOfRegisters(TTI.getRegisterClassForType(false));
+  uint64_t CacheSize =
+      FusionCacheSize ? FusionCacheSize
+                      : TTI.getCacheSize(TargetTransformInfo::CacheLevel::L1D)
+                            .value_or(32 * 1024);
+  uint64_t CacheLineSize = FusionCacheLineSize ? FusionCacheLineSize
+                                               : TTI.getCacheLineSize();
+  if (!CacheLineSize)
+    CacheLineSize = 64;
+
+  unsigned N = Loops.size();
+  const auto &DL = F.getParent()->getDataLayout();
+  SmallVector<bool, 8> InFusionForm;
+  SmallVector<unsigned, 8> VectorizableSize;
+  SmallVector<LoopFootprint, 8> Footprints;
+  for (auto *L : Loops) {
+    InFusionForm.push_back(Tentative ? canCanonicalize(L, DT, SE, DL)
+                                     : isInFusionForm(L, DT));
+    VectorizableSize.push_back(getVectorizableSize(L, SE));
+    Footprints.push_back(getFootprint(L, LI, SE, DL));
+  }
+
+  DenseMap<std::pair<unsigned, unsigned>, std::optional<int>> Edges;
+  auto getEdge = [&](unsigned A, unsigned B) {
+    auto [It, Inserted] = Edges.try_emplace({A, B});
+    int PeelCount;
+    if (Inserted && InFusionForm[A] && InFusionForm[B] &&
+        !usesLiveOuts(Loops[A], Loops[B]) &&
+        getPeelCount(Loops[A], Loops[B], F, FAM, PeelCount) &&
+        (Tentative || areLoopsCFE(Loops[A], Loops[B], F, FAM)) &&
+        Index.areLoopsIndependent(Loops[A], Loops[B]))
+      It->second = PeelCount;
+    return It->second;
+  };
+
+  auto isReuseImproved = [&](unsigned Prev, unsigned Next) {
+    uint64_t Unfused =
+        SaturatingAdd(Footprints[Prev].Bytes / 2, Footprints[Next].Bytes / 2);
+    uint64_t Fused = 0;
+    for (unsigned K = Prev; K <= Next; ++K) {
+      Fused = SaturatingAdd(Fused, Footprints[K].IterationBytes);
+      if (K != Prev && K != Next)
+        Unfused = SaturatingAdd(Unfused, Footprints[K].Bytes);
+    }
+    return Fused <= CacheSize && Unfused > CacheSize;
+  };
 
-  Loop *Lprev = nullptr;
-  bool hasBeenOptimized = false;
-  for (auto iter = LI.rbegin(); iter != LI.rend(); ++iter) {
-    Loop *L = *iter;
-    if (Lprev) {
-      if (areLoopsAdjacent(Lprev, L) && areLoopsTCE(Lprev, L, F, FAM) &&
-          areLoopsCFE(Lprev, L, F, FAM) &&
-          areLoopsIndependent(Lprev, L, F, FAM)) {
-        hasBeenOptimized = true;
-        Lprev = merge(Lprev, L, F, FAM);
+  auto getBenefit = [&](unsigned First, unsigned Last) -> std::optional<int> {
+    int Benefit = 0;
+    bool AllVectorizable = VectorizableSize[First] != 0;
+    SmallPtrSet<const Value *, 16> Objects(Footprints[First].Objects.begin(),
+                                           Footprints[First].Objects.end());
+    for (unsigned K = First + 1; K <= Last; ++K) {
+      unsigned Reuses = 0;
+      for (auto *Object : Footprints[K].Objects) {
+        // Measured from the last earlier loop that accessed the object.
+        for (unsigned Prev = K; Prev-- > First;) {
+          if (Footprints[Prev].Objects.count(Object)) {
+            Reuses += isReuseImproved(Prev, K);
+            break;
+          }
+        }
+      }
+      if (!Reuses)
+        return std::nullopt;
+      Benefit += LoopControlBenefit + CacheReuseBenefit * Reuses;
+      Objects.insert(Footprints[K].Objects.begin(),
+                     Footprints[K].Objects.end());
+      AllVectorizable &= VectorizableSize[K] != 0;
+    }
+    if (Objects.size() * CacheLineSize > CacheSize)
+      return std::nullopt;
+    if (!AllVectorizable) {
+      for (unsigned K = First; K <= Last; ++K)
+        Benefit -= VectorizableSize[K] / VectorizationLossDivisor;
+    }
+    return Benefit;
+  };
+
+  SmallVector<int, 8> Best(N + 1, 0);
+  SmallVector<FusionGroup, 8> LastGroup(N + 1);
+  for (unsigned Last = 0; Last < N; ++Last) {
+    Best[Last + 1] = Best[Last];
+    LastGroup[Last + 1] = {Last, Last, 0};
+
+    // The fused loop keeps a single induction variable.
+    SmallPtrSet<const Value *, 16> LiveValues;
+    getLiveValues(Loops[Last], LiveValues);
+    int InnerPeelCount = 0;
+    for (unsigned First = Last; First-- > 0 && InnerPeelCount == 0;) {
+      getLiveValues(Loops[First], LiveValues);
+      if (Registers && LiveValues.size() - (Last - First) > Registers)
+        break;
+
+      // Every following loop is fused into this one, once the same
+      // iterations are peeled off it.
+      auto PeelCount = getEdge(First, First + 1);
+      for (unsigned K = First + 2; K <= Last && PeelCount; ++K) {
+        if (getEdge(First, K) != PeelCount)
+          PeelCount = std::nullopt;
+      }
+      if (!PeelCount || (*PeelCount < 0 && Last != First + 1))
+        break;
+      InnerPeelCount = *PeelCount;
+
+      auto Benefit = getBenefit(First, Last);
+      if (Benefit && Best[First] + *Benefit > Best[Last + 1]) {
+        Best[Last + 1] = Best[First] + *Benefit;
+        LastGroup[Last + 1] = {First, Last, *PeelCount};
+      }
+    }
+  }
+
+  SmallVector<FusionGroup, 4> Groups;
+  for (unsigned End = N; End > 0; End = LastGroup[End].First) {
+    if (LastGroup[End].First != LastGroup[End].Last)
+      Groups.push_back(LastGroup[End]);
+  }
+  std::reverse(Groups.begin(), Groups.end());
+  return Groups;
+}
+
+// Fuses the runs of sibling loops chosen by partitionLoops, then moves on to
+// the inner loops of the resulting ones: the inner loops of two fused nests
+// become siblings, so whole nests are fused level by level, each level with
+// its own trip-count and dependence checks.
+//
+// Only the runs of a tentative partition are canonicalized, so that the loops
+// that are not fused keep the shape they came in. A run the final partition
+// still rejects stays canonicalized.
+bool LoopFusionPass::fuseLoops(ArrayRef<Loop *> Loops, Function &F,
+                               FunctionAnalysisManager &FAM,
+                               LoopDependenceIndex &Index) {
+  auto &SE = FAM.getResult<ScalarEvolutionAnalysis>(F);
+  bool Changed = false;
+  for (const auto &Group : partitionLoops(Loops, F, FAM, Index, true))
+    Changed |= canonicalizeLoops(
+        Loops.slice(Group.First, Group.Last - Group.First + 1), F, FAM, Index);
+
+  SmallVector<Loop *, 8> Remaining;
+  unsigned Next = 0;
+  for (const auto &Group : partitionLoops(Loops, F, FAM, Index, false)) {
+    Remaining.append(Loops.begin() + Next, Loops.begin() + Group.First);
+    Loop *Lprev = Loops[Group.First];
+    // Once the first loop is peeled, or a loop is left out, the following
+    // ones have the same trip count as the loop they are fused into.
+    int PeelCount = Group.PeelCount;
+    for (unsigned K = Group.First + 1; K <= Group.Last; ++K) {
+      Loop *L = Loops[K];
+      if (makeLoopsAdjacent(Lprev, L, F, FAM, Changed) &&
+          canNormalizeIVs(Lprev, L, SE)) {
+        Changed = true;
+        if (PeelCount > 0)
+          peelFirstIterations(Lprev, PeelCount, F, FAM, Index);
+        else if (PeelCount < 0)
+          peelLastIterations(L, -PeelCount, F, FAM, Index);
+        PeelCount = 0;
+        Lprev = merge(Lprev, L, F, FAM, Index);
       } else {
+        Remaining.push_back(Lprev);
         Lprev = L;
+        PeelCount = 0;
       }
-    } else {
-      Lprev = L;
+    }
+    Remaining.push_back(Lprev);
+    Next = Group.Last + 1;
+  }
+  Remaining.append(Loops.begin() + Next, Loops.end());
+
+  for (auto *L : Remaining) {
+    if (L->getSubLoops().size() > 1) {
+      SmallVector<Loop *, 4> SubLoops(L->begin(), L->end());
+      Changed |= fuseLoops(SubLoops, F, FAM, Index);
     }
   }
+  return Changed;
+}
+
+PreservedAnalyses LoopFusionPass::run(Function &F,
+                                      FunctionAnalysisManager &FAM) {
+  auto &LI = FAM.getResult<LoopAnalysis>(F);
+  LoopDependenceIndex Index(FAM.getResult<DependenceAnalysis>(F),
+                            FAM.getResult<AAManager>(F));
+
+  // Top-level loops are kept in reverse program order, inner loops are not.
+  SmallVector<Loop *, 8> Loops(LI.rbegin(), LI.rend());
+  bool hasBeenOptimized = fuseLoops(Loops, F, FAM, Index);
   return hasBeenOptimized ? PreservedAnalyses::none()
                           : PreservedAnalyses::all();
 }
@@ -0,0 +1,141 @@
+; RUN: opt -passes='custom-loop-distribution,verify<loops>' -verify-loop-info \
+; RUN:   -S < %s | FileCheck %s
+
+; The copy of b into a is split from the recurrence on c, and runs first in a
+; loop of its own.
+;
+;   for (i = 0; i < 100; i++) {
+;     a[i] = b[i] * 2;
+;     c[i + 1] = c[i] + a[i];
+;   }
+
+; CHECK-LABEL: @dist(
+; CHECK:       h.dist0:
+; CHECK:       body.dist0:
+; CHECK-NEXT:    %gb.dist0 = getelementptr inbounds i32, ptr %b, i64 %i.dist0
+; CHECK-NEXT:    %vb.dist0 = load i32, ptr %gb.dist0
+; CHECK-NEXT:    %m.dist0 = mul i32 %vb.dist0, 2
+; CHECK-NEXT:    %ga.dist0 = getelementptr inbounds i32, ptr %a, i64 %i.dist0
+; CHECK-NEXT:    store i32 %m.dist0, ptr %ga.dist0
+; CHECK-NEXT:    br label %l.dist0
+; CHECK:       h:
+; CHECK:       body:
+; CHECK-NOT:     load i32, ptr %gb
+; CHECK:         %vc = load i32, ptr %gc
+; CHECK-NEXT:    %va = load i32, ptr %ga
+; CHECK:         store i32 %s, ptr %gc1
+; CHECK:       exit:
+; CHECK-NEXT:    ret void
+
+define void @dist(ptr noalias %a, ptr noalias %b, ptr noalias %c) {
+entry:
+  br label %h
+
+h:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %l ]
+  %cmp = icmp slt i64 %i, 100
+  br i1 %cmp, label %body, label %exit
+
+body:
+  %gb = getelementptr inbounds i32, ptr %b, i64 %i
+  %vb = load i32, ptr %gb
+  %m = mul i32 %vb, 2
+  %ga = getelementptr inbounds i32, ptr %a, i64 %i
+  store i32 %m, ptr %ga
+  %gc = getelementptr inbounds i32, ptr %c, i64 %i
+  %vc = load i32, ptr %gc
+  %va = load i32, ptr %ga
+  %s = add i32 %vc, %va
+  %i1 = add nsw i64 %i, 1
+  %gc1 = getelementptr inbounds i32, ptr %c, i64 %i1
+  store i32 %s, ptr %gc1
+  br label %l
+
+l:
+  %i.next = add nsw i64 %i, 1
+  br label %h
+
+exit:
+  ret void
+}
+
+; The same loop calling a function that reads no memory but may throw: once
+; distributed, every store to a would be done before the first call.
+
+; CHECK-LABEL: @may_throw(
+; CHECK-NOT:   .dist0
+; CHECK:       ret void
+
+define void @may_throw(ptr noalias %a, ptr noalias %b, ptr noalias %c) {
+entry:
+  br label %h
+
+h:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %l ]
+  %cmp = icmp slt i64 %i, 100
+  br i1 %cmp, label %body, label %exit
+
+body:
+  %gb = getelementptr inbounds i32, ptr %b, i64 %i
+  %vb = load i32, ptr %gb
+  %m = mul i32 %vb, 2
+  %ga = getelementptr inbounds i32, ptr %a, i64 %i
+  store i32 %m, ptr %ga
+  %gc = getelementptr inbounds i32, ptr %c, i64 %i
+  %vc = load i32, ptr %gc
+  call void @check(i32 %vc) readnone willreturn
+  %va = load i32, ptr %ga
+  %s = add i32 %vc, %va
+  %i1 = add nsw i64 %i, 1
+  %gc1 = getelementptr inbounds i32, ptr %c, i64 %i1
+  store i32 %s, ptr %gc1
+  br label %l
+
+l:
+  %i.next = add nsw i64 %i, 1
+  br label %h
+
+exit:
+  ret void
+}
+
+; And calling one that may never return.
+
+; CHECK-LABEL: @may_not_return(
+; CHECK-NOT:   .dist0
+; CHECK:       ret void
+
+define void @may_not_return(ptr noalias %a, ptr noalias %b, ptr noalias %c) {
+entry:
+  br label %h
+
+h:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %l ]
+  %cmp = icmp slt i64 %i, 100
+  br i1 %cmp, label %body, label %exit
+
+body:
+  %gb = getelementptr inbounds i32, ptr %b, i64 %i
+  %vb = load i32, ptr %gb
+  %m = mul i32 %vb, 2
+  %ga = getelementptr inbounds i32, ptr %a, i64 %i
+  store i32 %m, ptr %ga
+  %gc = getelementptr inbounds i32, ptr %c, i64 %i
+  %vc = load i32, ptr %gc
+  call void @check(i32 %vc) readnone nounwind
+  %va = load i32, ptr %ga
+  %s = add i32 %vc, %va
+  %i1 = add nsw i64 %i, 1
+  %gc1 = getelementptr inbounds i32, ptr %c, i64 %i1
+  store i32 %s, ptr %gc1
+  br label %l
+
+l:
+  %i.next = add nsw i64 %i, 1
+  br label %h
+
+exit:
+  ret void
+}
+
+declare void @check(i32)
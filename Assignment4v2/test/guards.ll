@@ -0,0 +1,130 @@
+; RUN: opt -passes='custom-loop-fusion,verify<loops>' -verify-loop-info \
+; RUN:   -custom-loop-fusion-cache-size=1024 -S < %s | FileCheck %s
+
+; Two loops each guarded by n > 0. On the way out of the first loop the second
+; guard always holds, so the first guard skips both loops and the second one
+; is dropped.
+
+; CHECK-LABEL: @merged(
+; CHECK:       entry:
+; CHECK-NEXT:    %cmp0 = icmp sgt i32 %n, 0
+; CHECK-NEXT:    br i1 %cmp0, label %ph1, label %end
+; CHECK-NOT:     %cmp1
+
+@a = external global [256 x i32]
+@b = external global [256 x i32]
+
+define i32 @merged(i32 %n) {
+entry:
+  %cmp0 = icmp sgt i32 %n, 0
+  br i1 %cmp0, label %ph1, label %g2
+
+ph1:
+  %wide = zext i32 %n to i64
+  br label %body1
+
+body1:
+  %i = phi i64 [ 0, %ph1 ], [ %i.next, %body1 ]
+  %pa = getelementptr inbounds [256 x i32], ptr @a, i64 0, i64 %i
+  %va = load i32, ptr %pa, align 4
+  %va1 = add i32 %va, 3
+  %pb = getelementptr inbounds [256 x i32], ptr @b, i64 0, i64 %i
+  store i32 %va1, ptr %pb, align 4
+  %i.next = add nuw nsw i64 %i, 1
+  %ex = icmp eq i64 %i.next, %wide
+  br i1 %ex, label %exit1, label %body1
+
+exit1:
+  br label %g2
+
+g2:
+  %cmp1 = icmp sgt i32 %n, 0
+  br i1 %cmp1, label %ph2, label %end
+
+ph2:
+  %wide2 = zext i32 %n to i64
+  br label %body2
+
+body2:
+  %j = phi i64 [ 0, %ph2 ], [ %j.next, %body2 ]
+  %s = phi i32 [ 0, %ph2 ], [ %s.next, %body2 ]
+  %qa = getelementptr inbounds [256 x i32], ptr @a, i64 0, i64 %j
+  %wa = load i32, ptr %qa, align 4
+  %s.next = add i32 %s, %wa
+  %j.next = add nuw nsw i64 %j, 1
+  %ex2 = icmp eq i64 %j.next, %wide2
+  br i1 %ex2, label %exit2, label %body2
+
+exit2:
+  %s.lcssa = phi i32 [ %s.next, %body2 ]
+  br label %end
+
+end:
+  %r = phi i32 [ 0, %g2 ], [ %s.lcssa, %exit2 ]
+  ret i32 %r
+}
+
+; The second guard is also reached straight from the entry, where nothing has
+; tested n: it must stay, or that path would run the second loop for any n.
+
+; CHECK-LABEL: @unmerged(
+; CHECK:       entry:
+; CHECK-NEXT:    br i1 %c0, label %first, label %g2
+; CHECK:       first:
+; CHECK:         br i1 %cmp0, label %ph1, label %g2
+; CHECK:       g2:
+; CHECK-NEXT:    %cmp1 = icmp sgt i32 %n, 0
+; CHECK-NEXT:    br i1 %cmp1, label %ph2, label %end
+
+define i32 @unmerged(i32 %n, i1 %c0) {
+entry:
+  br i1 %c0, label %first, label %g2
+
+first:
+  %cmp0 = icmp sgt i32 %n, 0
+  br i1 %cmp0, label %ph1, label %g2
+
+ph1:
+  %wide = zext i32 %n to i64
+  br label %body1
+
+body1:
+  %i = phi i64 [ 0, %ph1 ], [ %i.next, %body1 ]
+  %pa = getelementptr inbounds [256 x i32], ptr @a, i64 0, i64 %i
+  %va = load i32, ptr %pa, align 4
+  %va1 = add i32 %va, 3
+  %pb = getelementptr inbounds [256 x i32], ptr @b, i64 0, i64 %i
+  store i32 %va1, ptr %pb, align 4
+  %i.next = add nuw nsw i64 %i, 1
+  %ex = icmp eq i64 %i.next, %wide
+  br i1 %ex, label %exit1, label %body1
+
+exit1:
+  br label %g2
+
+g2:                                               
+  %cmp1 = icmp sgt i32 %n, 0
+  br i1 %cmp1, label %ph2, label %end
+
+ph2:
+  %wide2 = zext i32 %n to i64
+  br label %body2
+
+body2:
+  %j = phi i64 [ 0, %ph2 ], [ %j.next, %body2 ]
+  %s = phi i32 [ 0, %ph2 ], [ %s.next, %body2 ]
+  %qa = getelementptr inbounds [256 x i32], ptr @a, i64 0, i64 %j
+  %wa = load i32, ptr %qa, align 4
+  %s.next = add i32 %s, %wa
+  %j.next = add nuw nsw i64 %j, 1
+  %ex2 = icmp eq i64 %j.next, %wide2
+  br i1 %ex2, label %exit2, label %body2
+
+exit2:
+  %s.lcssa = phi i32 [ %s.next, %body2 ]
+  br label %end
+
+end:
+  %r = phi i32 [ 0, %g2 ], [ %s.lcssa, %exit2 ]
+  ret i32 %r
+}
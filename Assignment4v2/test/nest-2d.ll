@@ -0,0 +1,69 @@
+; RUN: opt -passes='custom-loop-fusion,verify<loops>' -verify-loop-info \
+; RUN:   -custom-loop-fusion-cache-size=1024 -S < %s | FileCheck %s
+
+; The two inner loops of a 2-D nest are fused inside the outer loop, which
+; must not keep the blocks of the second inner loop once they are deleted.
+;
+;   for (i = 0; i < 20; i++) {
+;     for (j = 0; j < 100; j++)
+;       a[i * 100 + j] = c[i * 100 + j];
+;     for (k = 0; k < 100; k++)
+;       b[i * 100 + k] = c[i * 100 + k] * 2;
+;   }
+
+; CHECK-LABEL: @nest(
+; CHECK:       outer.header:
+; CHECK:       first.header:
+; CHECK-NEXT:    %j = phi i64
+; CHECK:         br i1 %first.cond, label %first.body, label %outer.latch
+; CHECK:         store i64 %c.val, ptr %a.x
+; CHECK:         store i64 %twice, ptr %b.y
+; CHECK-NOT:   second.header:
+; CHECK:       outer.latch:
+define void @nest(ptr noalias %a, ptr noalias %b, ptr noalias %c) {
+entry:
+  br label %outer.header
+outer.header:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %outer.latch ]
+  %outer.cond = icmp slt i64 %i, 20
+  br i1 %outer.cond, label %first.preheader, label %exit
+first.preheader:
+  %row = mul nsw i64 %i, 100
+  br label %first.header
+first.header:
+  %j = phi i64 [ 0, %first.preheader ], [ %j.next, %first.latch ]
+  %first.cond = icmp slt i64 %j, 100
+  br i1 %first.cond, label %first.body, label %second.preheader
+first.body:
+  %x = add nsw i64 %row, %j
+  %c.x = getelementptr inbounds i64, ptr %c, i64 %x
+  %c.val = load i64, ptr %c.x
+  %a.x = getelementptr inbounds i64, ptr %a, i64 %x
+  store i64 %c.val, ptr %a.x
+  br label %first.latch
+first.latch:
+  %j.next = add nsw i64 %j, 1
+  br label %first.header
+second.preheader:
+  br label %second.header
+second.header:
+  %k = phi i64 [ 0, %second.preheader ], [ %k.next, %second.latch ]
+  %second.cond = icmp slt i64 %k, 100
+  br i1 %second.cond, label %second.body, label %outer.latch
+second.body:
+  %y = add nsw i64 %row, %k
+  %c.y = getelementptr inbounds i64, ptr %c, i64 %y
+  %c.val2 = load i64, ptr %c.y
+  %twice = shl i64 %c.val2, 1
+  %b.y = getelementptr inbounds i64, ptr %b, i64 %y
+  store i64 %twice, ptr %b.y
+  br label %second.latch
+second.latch:
+  %k.next = add nsw i64 %k, 1
+  br label %second.header
+outer.latch:
+  %i.next = add nsw i64 %i, 1
+  br label %outer.header
+exit:
+  ret void
+}
@@ -0,0 +1,69 @@
+; RUN: opt -passes='custom-loop-fusion,verify<loops>' -verify-loop-info \
+; RUN:   -custom-loop-fusion-cache-size=256 -S < %s | FileCheck %s
+
+; The second loop runs two more iterations than the first one. They are
+; peeled off its back, after the fused loop, and carry the sum on.
+;
+;   for (i = 0; i < 100; i++)
+;     a[i] = b[i] + 1;
+;   for (j = 0; j < 102; j++) {
+;     c[j] = b[j] * 3;
+;     s += c[j];
+;   }
+
+; CHECK-LABEL: @epilogue(
+; CHECK:       body1:
+; CHECK:         %exitcond = icmp ne i64 %i, 100
+; CHECK-NEXT:    br i1 %exitcond, label %body1.body, label %body2.epilogue
+; CHECK:       body2.body:
+; CHECK:         store i32 %w, ptr %qc
+; CHECK:       body2.epilogue:
+; CHECK-NEXT:    %s.lcssa2 = phi i32 [ %s, %body1 ]
+; CHECK-NEXT:    %j.lcssa = phi i64 [ %i, %body1 ]
+; CHECK:       body2.body.peel:
+; CHECK:         %s.next.peel = add i32 %s.lcssa2, %w.peel
+; CHECK:         %j.next.peel = add nuw nsw i64 %j.lcssa, 1
+; CHECK:       body2.body.peel5:
+; CHECK:         %s.next.peel10 = add i32 %s.next.peel, %w.peel8
+; CHECK:       exit:
+; CHECK-NEXT:    %s.lcssa = phi i32 [ %s.next.peel10, %body2.body.latch.peel12 ]
+
+@a = global [256 x i32] zeroinitializer
+@b = global [256 x i32] zeroinitializer
+@c = global [256 x i32] zeroinitializer
+
+define i32 @epilogue() {
+entry:
+  br label %body1
+
+body1:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %body1 ]
+  %pb = getelementptr inbounds [256 x i32], ptr @b, i64 0, i64 %i
+  %vb = load i32, ptr %pb, align 4
+  %v1 = add i32 %vb, 1
+  %pa = getelementptr inbounds [256 x i32], ptr @a, i64 0, i64 %i
+  store i32 %v1, ptr %pa, align 4
+  %i.next = add nuw nsw i64 %i, 1
+  %ex = icmp eq i64 %i.next, 100
+  br i1 %ex, label %ph2, label %body1
+
+ph2:
+  br label %body2
+
+body2:
+  %j = phi i64 [ 0, %ph2 ], [ %j.next, %body2 ]
+  %s = phi i32 [ 0, %ph2 ], [ %s.next, %body2 ]
+  %qb = getelementptr inbounds [256 x i32], ptr @b, i64 0, i64 %j
+  %wb = load i32, ptr %qb, align 4
+  %w = mul i32 %wb, 3
+  %qc = getelementptr inbounds [256 x i32], ptr @c, i64 0, i64 %j
+  store i32 %w, ptr %qc, align 4
+  %s.next = add i32 %s, %w
+  %j.next = add nuw nsw i64 %j, 1
+  %ex2 = icmp eq i64 %j.next, 102
+  br i1 %ex2, label %exit, label %body2
+
+exit:
+  %s.lcssa = phi i32 [ %s.next, %body2 ]
+  ret i32 %s.lcssa
+}